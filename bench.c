@@ -0,0 +1,344 @@
+/*
+ * Benchmarks of what each part of taking a sample costs, written as JSON so
+ * that results can be compared between versions.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+
+/* How long to repeat each operation for, in ns. */
+#define BENCH_TIME 200000000LL
+
+char *argv0;
+
+/* The JSON document, built up here and only written out once every
+ * benchmark has run, so that a failure never leaves half an object. */
+static FILE *json;
+
+/* What one benchmark of an operation found. */
+struct result {
+	unsigned long calls;
+	double ns;          /* Nanoseconds per call. */
+};
+
+static int bench(int (*fn)(void *), void *arg, struct result *r);
+static int benchreaders(void);
+static int benchwriters(const char *dir);
+static int benchparse(void);
+static int benchendtoend(const char *cpuwatch, const char *dir);
+static char *fakestat(int ncpu, size_t *len);
+
+/*
+ * Run each group of benchmarks in turn, writing a JSON object with a member
+ * for each group to stdout once they have all run, or nothing if any fail.
+ * The end-to-end benchmarks run the cpuwatch given as the only argument,
+ * ./cpuwatch by default.
+ *
+ * Returns 0 if every benchmark ran, or -1 if not.
+ */
+int main(int argc, char **argv)
+{
+	argv0 = argv[0];
+	const char *cpuwatch = argc > 1 ? argv[1] : "./cpuwatch";
+
+	char dir[] = "/tmp/cpuwatch-bench.XXXXXX";
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "%s: Could not make a directory to work in (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+
+	char *doc = NULL;
+	size_t len = 0;
+	if (!(json = open_memstream(&doc, &len))) {
+		fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+		        argv0, strerror(errno));
+		rmdir(dir);
+		return -1;
+	}
+	fprintf(json, "{\n  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	int err = benchreaders() < 0 || benchwriters(dir) < 0 ||
+	          benchparse() < 0 || benchendtoend(cpuwatch, dir) < 0;
+	fprintf(json, "}\n");
+	if (fclose(json) == EOF) {
+		fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+		        argv0, strerror(errno));
+		err = 1;
+	}
+	if (!err) {
+		fwrite(doc, 1, len, stdout);
+	}
+	free(doc);
+
+	rmdir(dir);
+	return err ? -1 : 0;
+}
+
+/*
+ * Call fn(arg) over and over for about BENCH_TIME, in batches which double in
+ * size, so the clock is read rarely compared with the calls.
+ *
+ * On success, 0 is returned, and r is filled in.
+ * On failure of fn, -1 is returned.
+ */
+static int bench(int (*fn)(void *), void *arg, struct result *r)
+{
+	int64_t start, now;
+	unsigned long batch = 1;
+
+	r->calls = 0;
+	monotime(&start);
+	do {
+		for (unsigned long i = 0; i < batch; i++) {
+			if (fn(arg) < 0) {
+				return -1;
+			}
+		}
+		r->calls += batch;
+		batch *= 2;
+		monotime(&now);
+	} while (now - start < BENCH_TIME);
+
+	r->ns = (double)(now - start) / r->calls;
+	return 0;
+}
+
+static int readuptimeonly(void *arg)
+{
+	struct sample s;
+	struct procsource *p = arg;
+	if (readproc(p, 0) < 0) {
+		return -1;
+	}
+	return parseuptime(p->uptime, &s.uptime, &s.idle);
+}
+
+static int readuptimestat(void *arg)
+{
+	static struct cpustat st;
+	struct sample s;
+	struct procsource *p = arg;
+	if (readproc(p, 1) < 0 || parseuptime(p->uptime, &s.uptime, &s.idle) < 0) {
+		return -1;
+	}
+	return parsestat(&st, p->stat, p->statlen);
+}
+
+static int readcpuscall(void *arg)
+{
+	return readcpus(arg) < 0 ? -1 : 0;
+}
+
+/*
+ * Time taking a sample from /proc: reading and parsing uptime alone, and with
+ * stat, and checking the CPUs online.
+ */
+static int benchreaders(void)
+{
+	struct procsource p;
+	struct cpuinfo ci;
+	struct result up, upstat, cpus;
+
+	memset(&ci, 0, sizeof(ci));
+	if (openproc(&p, NULL, 0, NULL, NULL) < 0 ||
+	    bench(readuptimeonly, &p, &up) < 0 ||
+	    bench(readuptimestat, &p, &upstat) < 0 ||
+	    bench(readcpuscall, &ci, &cpus) < 0) {
+		return -1;
+	}
+
+	fprintf(json, "  \"readers\": {\n"
+	        "    \"uptime\": {\"calls\": %lu, \"ns_per_call\": %.1f},\n"
+	        "    \"uptime_stat\": {\"calls\": %lu, \"ns_per_call\": %.1f},\n"
+	        "    \"cpus\": {\"calls\": %lu, \"ns_per_call\": %.1f}\n"
+	        "  },\n", up.calls, up.ns, upstat.calls, upstat.ns,
+	        cpus.calls, cpus.ns);
+	return 0;
+}
+
+static int writeutilcall(void *arg)
+{
+	return writeutil(arg, 12.3);
+}
+
+/*
+ * Time writing a utilisation to a file in dir with each output strategy.
+ */
+static int benchwriters(const char *dir)
+{
+	char path[256];
+
+	fprintf(json, "  \"writers\": {\n");
+	for (int m = 0; m < NOUTMODES; m++) {
+		struct output out;
+		struct result r;
+		snprintf(path, sizeof(path), "%s/%s", dir, outmodenames[m]);
+		if (openoutput(&out, path, m) < 0 || bench(writeutilcall, &out,
+		                                           &r) < 0) {
+			return -1;
+		}
+		fprintf(json, "    \"%s\": {\"calls\": %lu, "
+		        "\"ns_per_call\": %.1f}%s\n", outmodenames[m], r.calls,
+		        r.ns, m + 1 < NOUTMODES ? "," : "");
+		if (out.fd >= 0) {
+			close(out.fd);
+		}
+		unlink(path);
+	}
+	fprintf(json, "  },\n");
+	return 0;
+}
+
+/* A synthetic /proc/stat to be parsed over and over. */
+struct parsejob {
+	char *buf;
+	size_t len;
+	struct cpustat st;
+};
+
+static int parsestatcall(void *arg)
+{
+	struct parsejob *j = arg;
+	return parsestat(&j->st, j->buf, j->len);
+}
+
+/*
+ * Time parsing a synthetic /proc/stat listing 1, 64 and 512 CPUs.
+ */
+static int benchparse(void)
+{
+	static const int sizes[] = { 1, 64, 512 };
+	int n = sizeof(sizes) / sizeof(*sizes);
+
+	fprintf(json, "  \"parse_stat\": {\n");
+	for (int i = 0; i < n; i++) {
+		struct parsejob j;
+		struct result r;
+		memset(&j, 0, sizeof(j));
+		if (!(j.buf = fakestat(sizes[i], &j.len)) ||
+		    bench(parsestatcall, &j, &r) < 0) {
+			return -1;
+		}
+		fprintf(json, "    \"%d\": {\"bytes\": %zu, \"calls\": %lu, "
+		        "\"ns_per_call\": %.1f, \"mb_per_s\": %.1f}%s\n",
+		        sizes[i], j.len, r.calls, r.ns, j.len / r.ns * 1e3,
+		        i + 1 < n ? "," : "");
+		free(j.buf);
+		freestat(&j.st);
+	}
+	fprintf(json, "  },\n");
+	return 0;
+}
+
+/*
+ * Make up the contents of /proc/stat for a machine with ncpu CPUs, with the
+ * lines which follow the CPUs in the real file.
+ *
+ * Returns the contents, which should be freed, or NULL on failure.
+ */
+static char *fakestat(int ncpu, size_t *len)
+{
+	struct buf b = { NULL, 0, 0, 0, 0 };
+
+	for (int i = -1; i < ncpu; i++) {
+		uint64_t scale = i < 0 ? ncpu : 1;
+		if (i < 0) {
+			bufputs(&b, "cpu ");
+		} else {
+			bufputs(&b, "cpu");
+			bufputu(&b, i);
+		}
+		for (int m = 0; m < NMODES; m++) {
+			uint64_t v = m == MODE_IDLE ? 98765432 :
+			             m >= MODE_STEAL ? 0 : 123456 + 1111 * m + i;
+			bufput(&b, " ", 1);
+			bufputu(&b, v * scale);
+		}
+		bufput(&b, "\n", 1);
+	}
+	bufputs(&b, "intr 1234567890 0 9 0 0 0 0 0 0 0 0 0 0 0 0 0 0\n"
+	            "ctxt 9876543210\nbtime 1660608000\n"
+	            "processes 1234567\nprocs_running 2\nprocs_blocked 0\n"
+	            "softirq 123456789 0 1234 5 6789 0 0 12 3456 0 78901\n");
+
+	if (b.err) {
+		fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+		        argv0, strerror(errno));
+		free(b.data);
+		return NULL;
+	}
+	*len = b.len;
+	return b.data;
+}
+
+/*
+ * Run cpuwatch at intervals of 1ms, 10ms and 1s for a while each, and find
+ * the CPU time it used from its resource usage.
+ */
+static int benchendtoend(const char *cpuwatch, const char *dir)
+{
+	static const char *const intervals[] = { "0.001", "0.01", "1" };
+	static const double seconds[] = { 2, 2, 5 };
+	int n = sizeof(intervals) / sizeof(*intervals);
+	char out[256];
+
+	snprintf(out, sizeof(out), "%s/endtoend", dir);
+	fprintf(json, "  \"end_to_end\": {\n");
+	for (int i = 0; i < n; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "%s: Could not fork (%s)\n",
+			        argv0, strerror(errno));
+			return -1;
+		}
+		if (pid == 0) {
+			execl(cpuwatch, cpuwatch, "-o", out, "-i", intervals[i],
+			      (char *)NULL);
+			fprintf(stderr, "%s: Could not run %s (%s)\n",
+			        argv0, cpuwatch, strerror(errno));
+			_exit(127);
+		}
+
+		struct timespec ts = {
+			.tv_sec = (time_t)seconds[i],
+			.tv_nsec = (long)((seconds[i] - (time_t)seconds[i]) * 1e9)
+		};
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+		kill(pid, SIGTERM);
+
+		int status;
+		struct rusage ru;
+		if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s: %s -i %s did not run properly\n",
+			        argv0, cpuwatch, intervals[i]);
+			return -1;
+		}
+
+		double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		             ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+		double samples = seconds[i] / atof(intervals[i]) + 1;
+		fprintf(json, "    \"%s\": {\"seconds\": %g, "
+		        "\"samples_scheduled\": %.0f, \"cpu_seconds\": %.6f, "
+		        "\"cpu_percent\": %.4f, \"us_per_sample\": %.2f}%s\n",
+		        intervals[i], seconds[i], samples, cpu,
+		        100 * cpu / seconds[i], cpu / samples * 1e6,
+		        i + 1 < n ? "," : "");
+	}
+	fprintf(json, "  }\n");
+	unlink(out);
+	return 0;
+}
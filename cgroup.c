@@ -0,0 +1,311 @@
+/*
+ * Per-cgroup CPU usage read from the cgroup (version 2) cpu.stat and cpu.max
+ * files.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+
+/* Where the cgroup version 2 hierarchy is mounted. */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+static int findcgroup(struct cgroup *cg);
+static void losecgroup(struct cgroup *cg, const char *why);
+static void closecgroupfiles(struct cgroup *cg);
+static int parsecgroupstat(struct cgroupstat *st, const char *c);
+
+/*
+ * Prepare to watch the cgroup at path, which is taken relative to the root
+ * of the cgroup hierarchy (as in /proc/PID/cgroup), or failing that as the
+ * path of its directory.
+ *
+ * The cgroup's directory is opened once, and cpu.stat and cpu.max opened
+ * from it and kept open, so each sample is one pread of each and a stat of
+ * the directory, to notice it being replaced. The label for its metrics, and
+ * room for the path of its directory, are also made here, so that nothing is
+ * allocated for a sample.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int opencgroup(struct cgroup *cg, const char *path)
+{
+	memset(cg, 0, sizeof(*cg));
+	cg->path = path;
+	cg->dir = cg->statfd = cg->maxfd = -1;
+
+	/* The path goes in a label as cgroup="PATH", with quotes, backslashes
+	 * and newlines escaped. */
+	cg->label = malloc(2 * strlen(path) + sizeof("cgroup=\"\""));
+	if (!cg->label) {
+		fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+	char *l = stpcpy(cg->label, "cgroup=\"");
+	for (const char *c = path; *c; c++) {
+		if (*c == '"' || *c == '\\' || *c == '\n') {
+			*l++ = '\\';
+		}
+		*l++ = *c == '\n' ? 'n' : *c;
+	}
+	strcpy(l, "\"");
+
+	cg->dirpath = malloc(sizeof(CGROUP_ROOT "/") + strlen(path));
+	if (!cg->dirpath) {
+		fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+
+	if (findcgroup(cg) < 0) {
+		fprintf(stderr, "%s: Could not open the cgroup '%s' (%s)\n",
+		        argv0, path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open the cgroup's directory, and its cpu.stat and cpu.max files, noting
+ * where the directory was found and its inode. The root cgroup has no
+ * cpu.max, as it has no limit.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int findcgroup(struct cgroup *cg)
+{
+	const char *rel = cg->path + strspn(cg->path, "/");
+	struct stat sb;
+
+	int root = open(CGROUP_ROOT, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (root >= 0) {
+		cg->dir = openat(root, *rel ? rel : ".",
+		                 O_PATH | O_DIRECTORY | O_CLOEXEC);
+		close(root);
+	}
+	if (cg->dir >= 0) {
+		strcpy(stpcpy(cg->dirpath, CGROUP_ROOT "/"), rel);
+	} else {
+		cg->dir = open(cg->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		strcpy(cg->dirpath, cg->path);
+	}
+	if (cg->dir < 0) {
+		return -1;
+	}
+
+	if (fstat(cg->dir, &sb) == 0) {
+		cg->dev = sb.st_dev;
+		cg->ino = sb.st_ino;
+		cg->statfd = openat(cg->dir, "cpu.stat", O_RDONLY | O_CLOEXEC);
+	}
+	if (cg->statfd < 0) {
+		int err = errno;
+		close(cg->dir);
+		cg->dir = -1;
+		errno = err;
+		return -1;
+	}
+	cg->maxfd = openat(cg->dir, "cpu.max", O_RDONLY | O_CLOEXEC);
+	cg->present = 1;
+	cg->primed = 0;
+	return 0;
+}
+
+/*
+ * Read the cgroup's counters, and work out its usage since the last reading
+ * as a percentage of what its cpu.max allows, or of ncpu CPUs if it has no
+ * limit, so that 100% means it is at its limit.
+ *
+ * A cgroup which has gone away, as a container's does when it stops, is not
+ * an error: it is reported once on stderr, and then looked for again by its
+ * path each sample until it is back. One which has been replaced by another
+ * at the same path is opened again, and its figures start afresh.
+ */
+void readcgroup(struct cgroup *cg, double ncpu)
+{
+	char buf[1024];
+	struct cgroupstat st;
+	struct stat sb;
+	int64_t now;
+	ssize_t n;
+
+	if (cg->present) {
+		if (stat(cg->dirpath, &sb) < 0) {
+			losecgroup(cg, strerror(errno));
+		} else if (sb.st_dev != cg->dev || sb.st_ino != cg->ino) {
+			closecgroupfiles(cg);
+		}
+	}
+	if (!cg->present && findcgroup(cg) < 0) {
+		return;
+	}
+
+	monotime(&now);
+	while ((n = pread(cg->statfd, buf, sizeof(buf) - 1, 0)) < 0 &&
+	       errno == EINTR);
+	if (n <= 0) {
+		losecgroup(cg, n ? strerror(errno) : "empty cpu.stat");
+		return;
+	}
+	buf[n] = '\0';
+	if (parsecgroupstat(&st, buf) < 0) {
+		losecgroup(cg, "cpu.stat has no usage_usec");
+		return;
+	}
+
+	cg->limit = 0;
+	if (cg->maxfd >= 0 &&
+	    (n = pread(cg->maxfd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[n] = '\0';
+		cg->limit = parsecpumax(buf);
+	}
+	if (cg->limit <= 0) {
+		cg->limit = ncpu;
+	}
+
+	/* The counters only go back if the cgroup was replaced, so if any has
+	 * they are taken as the start of a new interval. */
+	if (cg->primed && now > cg->at && st.usage >= cg->cur.usage &&
+	    st.user >= cg->cur.user && st.system >= cg->cur.system &&
+	    st.nrthrottled >= cg->cur.nrthrottled &&
+	    st.throttled >= cg->cur.throttled) {
+		cg->delta.usage = st.usage - cg->cur.usage;
+		cg->delta.user = st.user - cg->cur.user;
+		cg->delta.system = st.system - cg->cur.system;
+		cg->delta.nrthrottled = st.nrthrottled - cg->cur.nrthrottled;
+		cg->delta.throttled = st.throttled - cg->cur.throttled;
+		double avail = (now - cg->at) / 1e3 * cg->limit;
+		cg->util = 100 * cg->delta.usage / avail;
+		cg->userutil = 100 * cg->delta.user / avail;
+		cg->systemutil = 100 * cg->delta.system / avail;
+		cg->ready = 1;
+	} else {
+		cg->ready = 0;
+	}
+	cg->cur = st;
+	cg->at = now;
+	cg->primed = 1;
+}
+
+/*
+ * Close a cgroup's files after failing to read them, saying why on stderr.
+ */
+static void losecgroup(struct cgroup *cg, const char *why)
+{
+	fprintf(stderr, "%s: Lost the cgroup '%s' (%s); looking for it again "
+	        "each sample\n", argv0, cg->path, why);
+	closecgroupfiles(cg);
+}
+
+/*
+ * Close a cgroup's files, so that it is looked for again by its path, and
+ * its figures start afresh when it is found.
+ */
+static void closecgroupfiles(struct cgroup *cg)
+{
+	close(cg->statfd);
+	if (cg->maxfd >= 0) {
+		close(cg->maxfd);
+	}
+	close(cg->dir);
+	cg->dir = cg->statfd = cg->maxfd = -1;
+	cg->present = cg->primed = cg->ready = 0;
+}
+
+/*
+ * Parse the counters of interest from the contents of cpu.stat, which holds
+ * one "name value" pair to a line. The throttling counters are only there if
+ * the cpu controller is enabled for the cgroup, and are otherwise 0.
+ *
+ * On success, 0 is returned.
+ * On failure, if there is no usage_usec, -1 is returned.
+ */
+static int parsecgroupstat(struct cgroupstat *st, const char *c)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} fields[] = {
+		{ "usage_usec ", offsetof(struct cgroupstat, usage) },
+		{ "user_usec ", offsetof(struct cgroupstat, user) },
+		{ "system_usec ", offsetof(struct cgroupstat, system) },
+		{ "nr_throttled ", offsetof(struct cgroupstat, nrthrottled) },
+		{ "throttled_usec ", offsetof(struct cgroupstat, throttled) },
+	};
+	int found = 0;
+
+	memset(st, 0, sizeof(*st));
+	for (; *c; c += strcspn(c, "\n"), c += *c == '\n') {
+		for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+			size_t len = strlen(fields[i].name);
+			if (strncmp(c, fields[i].name, len)) {
+				continue;
+			}
+			uint64_t v = 0;
+			for (c += len; *c >= '0' && *c <= '9'; c++) {
+				v = v * 10 + (*c - '0');
+			}
+			*(uint64_t *)((char *)st + fields[i].offset) = v;
+			found |= i == 0;
+			break;
+		}
+	}
+	return found ? 0 : -1;
+}
+
+/*
+ * Append a line for the cgroup to b: its path, its usage over the last
+ * interval as a percentage of its limit, the same split into user and system
+ * time, its limit in CPUs, and the periods it was throttled in and for how
+ * many milliseconds, e.g.
+ * "/system.slice 45.2% user 30.1 system 15.1 limit 2.0 nr_throttled 3
+ * throttled_ms 12.5". A cgroup without a figure yet, or which has gone, has
+ * "-" in place of all of them.
+ */
+void rendercgroup(const struct cgroup *cg, struct buf *b)
+{
+	bufputs(b, cg->path);
+	if (!cg->ready) {
+		bufputs(b, " -\n");
+		return;
+	}
+	bufput(b, " ", 1);
+	bufputpercent(b, cg->util);
+	bufputs(b, " user ");
+	bufputfixed(b, cg->userutil);
+	bufputs(b, " system ");
+	bufputfixed(b, cg->systemutil);
+	bufputs(b, " limit ");
+	bufputfixed(b, cg->limit);
+	bufputs(b, " nr_throttled ");
+	bufputu(b, cg->delta.nrthrottled);
+	bufputs(b, " throttled_ms ");
+	bufputfixed(b, cg->delta.throttled / 1e3);
+	bufput(b, "\n", 1);
+}
+
+/*
+ * Close the cgroup's files.
+ */
+void closecgroup(struct cgroup *cg)
+{
+	if (cg->present) {
+		closecgroupfiles(cg);
+	}
+	free(cg->label);
+	free(cg->dirpath);
+	memset(cg, 0, sizeof(*cg));
+}
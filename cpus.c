@@ -0,0 +1,262 @@
+/*
+ * Detection of the number of CPUs available.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+
+static int countcpulist(const char *c);
+static int readaffinity(void);
+static double readquota(void);
+
+/*
+ * Work out how many CPUs are online, how many of them this process may run
+ * on, and how many CPUs' worth of time its cgroup allows it.
+ *
+ * The list of online CPUs in sysfs is kept open and re-read with a single
+ * pread on each call. Only when it has changed since the last call (or on the
+ * first call) are the affinity mask and cgroup quota looked at again, so this
+ * is cheap enough to call for every sample and still notice CPU hotplug.
+ *
+ * On success, 1 is returned if anything has changed since the last call and 0
+ * if not, and ci is up to date.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int readcpus(struct cpuinfo *ci)
+{
+	static int fd = -2;
+	static char last[256];
+	char buf[sizeof(last)];
+	int online;
+
+	if (fd == -2) {
+		fd = open("/sys/devices/system/cpu/online", O_RDONLY | O_CLOEXEC);
+	}
+
+	if (fd >= 0) {
+		ssize_t n;
+		while ((n = pread(fd, buf, sizeof(buf) - 1, 0)) < 0 && errno == EINTR);
+		if (n <= 0) {
+			fprintf(stderr, "%s: Error reading the list of online CPUs (%s)\n",
+			        argv0, n ? strerror(errno) : "empty file");
+			return -1;
+		}
+		buf[n] = '\0';
+
+		if (ci->online && !strcmp(buf, last)) {
+			return 0;
+		}
+		memcpy(last, buf, n + 1);
+		online = countcpulist(buf);
+	} else {
+		/* Without sysfs, fall back to what libc can tell us. */
+		online = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ci->online == online) {
+			return 0;
+		}
+	}
+
+	if (online <= 0) {
+		fprintf(stderr, "%s: Could not count the online CPUs\n", argv0);
+		errno = EINVAL;
+		return -1;
+	}
+
+	ci->online = online;
+	ci->affinity = readaffinity();
+	ci->quota = readquota();
+
+	ci->capacity = online;
+	if (ci->affinity > 0 && ci->affinity < ci->capacity) {
+		ci->capacity = ci->affinity;
+	}
+	if (ci->quota > 0 && ci->quota < ci->capacity) {
+		ci->capacity = ci->quota;
+	}
+	return 1;
+}
+
+/*
+ * Count the CPUs in a list such as "0-3,8,10-11", the format used by sysfs.
+ *
+ * Returns the number of CPUs, or -1 if the list is malformed.
+ */
+static int countcpulist(const char *c)
+{
+	int count = 0;
+
+	while (*c >= '0' && *c <= '9') {
+		int first = 0, last;
+		for (; *c >= '0' && *c <= '9'; c++) {
+			first = first * 10 + (*c - '0');
+		}
+		last = first;
+		if (*c == '-') {
+			last = 0;
+			for (c++; *c >= '0' && *c <= '9'; c++) {
+				last = last * 10 + (*c - '0');
+			}
+		}
+		if (last < first) {
+			return -1;
+		}
+		count += last - first + 1;
+
+		if (*c == ',') {
+			c++;
+		}
+	}
+
+	return *c == '\n' || *c == '\0' ? count : -1;
+}
+
+/*
+ * Count the CPUs this process may run on.
+ *
+ * Returns the number of CPUs, or 0 if it could not be found out.
+ */
+static int readaffinity(void)
+{
+	for (int n = 1024; n <= 1 << 20; n *= 2) {
+		cpu_set_t *set = CPU_ALLOC(n);
+		size_t size = CPU_ALLOC_SIZE(n);
+		if (!set) {
+			return 0;
+		}
+
+		if (sched_getaffinity(0, size, set) == 0) {
+			int count = CPU_COUNT_S(size, set);
+			CPU_FREE(set);
+			return count;
+		}
+		CPU_FREE(set);
+
+		/* EINVAL means the mask was too small for the kernel's. */
+		if (errno != EINVAL) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the number of CPUs' worth of time this process is allowed by the
+ * cpu.max limits of its cgroup (version 2) and all the cgroups above it. A
+ * limit of "200000 100000" for instance allows 2 CPUs.
+ *
+ * Returns the smallest limit found, or 0 if there is none.
+ */
+static double readquota(void)
+{
+	char path[4096];
+	char buf[4096];
+	double quota = 0;
+
+	/* In cgroup v2 /proc/self/cgroup holds a single line, "0::/path". */
+	int fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+
+	char *c = strstr(buf, "0::/");
+	if (!c || (c != buf && c[-1] != '\n')) {
+		return 0;
+	}
+	c += 3;
+	size_t len = strcspn(c, "\n");
+	if (len + sizeof("/sys/fs/cgroup/cpu.max") > sizeof(path)) {
+		return 0;
+	}
+	memcpy(path, "/sys/fs/cgroup", 14);
+	memcpy(path + 14, c, len);
+	len += 14;
+
+	/* Walk up from the process's own cgroup to the root. */
+	while (1) {
+		while (len > 14 && path[len - 1] == '/') {
+			len--;
+		}
+		memcpy(path + len, "/cpu.max", sizeof("/cpu.max"));
+
+		double q = readcpumax(path);
+		if (q > 0 && (quota == 0 || q < quota)) {
+			quota = q;
+		}
+
+		if (len <= 14) {
+			break;
+		}
+		while (len > 14 && path[len - 1] != '/') {
+			len--;
+		}
+	}
+
+	return quota;
+}
+
+/*
+ * Read a cgroup v2 cpu.max file, which holds a quota and a period in
+ * microseconds (or "max" for no quota), and return the number of CPUs' worth
+ * of time it allows.
+ *
+ * Returns the limit, or 0 if there is none or the file cannot be read.
+ */
+double readcpumax(const char *path)
+{
+	char buf[64];
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = '\0';
+
+	return parsecpumax(buf);
+}
+
+/*
+ * Parse the contents of a cgroup v2 cpu.max file.
+ *
+ * Returns the number of CPUs' worth of time allowed, or 0 for no limit.
+ */
+double parsecpumax(const char *c)
+{
+	unsigned long long quota = 0, period = 0;
+
+	if (*c < '0' || *c > '9') {
+		return 0; /* "max" */
+	}
+	for (; *c >= '0' && *c <= '9'; c++) {
+		quota = quota * 10 + (*c - '0');
+	}
+	while (*c == ' ') {
+		c++;
+	}
+	for (; *c >= '0' && *c <= '9'; c++) {
+		period = period * 10 + (*c - '0');
+	}
+
+	return period ? (double)quota / period : 0;
+}
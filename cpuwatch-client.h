@@ -0,0 +1,466 @@
+/*
+ * Header-only access to the figures published by cpuwatch: the shared memory
+ * segment written with --shm, the stream of updates sent with --subscribe, and
+ * the history file written with --history.
+ *
+ * When cpuwatch is run with --shm=NAME, it keeps the latest utilisation in a
+ * POSIX shared memory segment. A program can map the segment once with
+ * cpuwatch_shm_open(), then take a consistent snapshot with cpuwatch_shm_read()
+ * as often as it likes without making any system calls:
+ *
+ *	struct cpuwatch_shm *shm = cpuwatch_shm_open("/cpuwatch");
+ *	struct cpuwatch_snapshot snap;
+ *	if (shm && cpuwatch_shm_read(shm, &snap) == 0)
+ *		printf("%.1f%%\n", snap.util);
+ *
+ * When several moving averages are being taken (cpuwatch -n1 -n10 -n60 ...),
+ * snap.windows holds each of them in the order they were given, and snap.util
+ * is the first.
+ *
+ * The segment is protected by a sequence lock: the writer makes the sequence
+ * number odd while it updates the segment, and even again when it is done. A
+ * reader copies the segment and retries if the sequence number was odd or has
+ * changed, so it never sees a torn update and never blocks the writer.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#ifndef CPUWATCH_CLIENT_H
+#define CPUWATCH_CLIENT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CPUWATCH_SHM_MAGIC 0x57555043 /* "CPUW" */
+#define CPUWATCH_SHM_VERSION 3
+#define CPUWATCH_SHM_MAXWINDOWS 16
+
+/* One of the moving averages cpuwatch is taking. */
+struct cpuwatch_window {
+	double util;        /* CPU utilisation as a percentage. */
+	double seconds;     /* Length of the window in seconds, or its half-life
+	                     * if it is exponentially weighted. */
+	double p50;         /* With cpuwatch --percentiles, percentiles and the */
+	double p90;         /* maximum of the utilisation over each interval in */
+	double p99;         /* the window. Otherwise they equal util. */
+	double max;
+};
+
+/* The layout of the shared memory segment. Every field after seq must only be
+ * read between two reads of seq, as cpuwatch_shm_read() does. */
+struct cpuwatch_shm {
+	uint32_t magic;     /* CPUWATCH_SHM_MAGIC once the segment is set up. */
+	uint32_t version;   /* CPUWATCH_SHM_VERSION. */
+	uint64_t seq;       /* Odd while an update is in progress. */
+	uint64_t sample;    /* Number of the sample, counting from 1. */
+	int64_t realtime;   /* CLOCK_REALTIME when it was taken, in ns. */
+	int64_t monotonic;  /* CLOCK_MONOTONIC when it was taken, in ns. */
+	double util;        /* CPU utilisation of the first window. */
+	double ncpu;        /* Number of CPUs it was divided between. */
+	uint32_t nwindows;  /* Number of windows in use. */
+	uint32_t reserved;
+	struct cpuwatch_window windows[CPUWATCH_SHM_MAXWINDOWS];
+};
+
+/* A consistent copy of the figures in the segment. */
+struct cpuwatch_snapshot {
+	uint64_t sample;
+	int64_t realtime;
+	int64_t monotonic;
+	double util;
+	double ncpu;
+	uint32_t nwindows;
+	struct cpuwatch_window windows[CPUWATCH_SHM_MAXWINDOWS];
+};
+
+/*
+ * Map the segment published by cpuwatch --shm=NAME for reading.
+ *
+ * Returns the mapping, or NULL with errno set if it could not be mapped or is
+ * not a segment written by a compatible version of cpuwatch.
+ */
+static inline struct cpuwatch_shm *cpuwatch_shm_open(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct cpuwatch_shm)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void *p = mmap(NULL, sizeof(struct cpuwatch_shm), PROT_READ, MAP_SHARED,
+	               fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct cpuwatch_shm *shm = (struct cpuwatch_shm *)p;
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != CPUWATCH_SHM_MAGIC ||
+	    shm->version != CPUWATCH_SHM_VERSION) {
+		munmap(p, sizeof(struct cpuwatch_shm));
+		errno = EINVAL;
+		return NULL;
+	}
+	return shm;
+}
+
+/*
+ * Take a consistent snapshot of the segment, retrying while the writer is
+ * part way through an update. No system calls are made.
+ *
+ * Returns 0 on success, or -1 if no sample has been published yet.
+ */
+static inline int cpuwatch_shm_read(const struct cpuwatch_shm *shm,
+                                    struct cpuwatch_snapshot *snap)
+{
+	uint64_t seq;
+
+	do {
+		while ((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1) {
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#endif
+		}
+		snap->sample = __atomic_load_n(&shm->sample, __ATOMIC_RELAXED);
+		snap->realtime = __atomic_load_n(&shm->realtime, __ATOMIC_RELAXED);
+		snap->monotonic = __atomic_load_n(&shm->monotonic, __ATOMIC_RELAXED);
+		__atomic_load(&shm->util, &snap->util, __ATOMIC_RELAXED);
+		__atomic_load(&shm->ncpu, &snap->ncpu, __ATOMIC_RELAXED);
+		snap->nwindows = __atomic_load_n(&shm->nwindows, __ATOMIC_RELAXED);
+		if (snap->nwindows > CPUWATCH_SHM_MAXWINDOWS) {
+			snap->nwindows = CPUWATCH_SHM_MAXWINDOWS;
+		}
+		for (uint32_t i = 0; i < snap->nwindows; i++) {
+			__atomic_load(&shm->windows[i].util, &snap->windows[i].util,
+			              __ATOMIC_RELAXED);
+			__atomic_load(&shm->windows[i].seconds, &snap->windows[i].seconds,
+			              __ATOMIC_RELAXED);
+			__atomic_load(&shm->windows[i].p50, &snap->windows[i].p50,
+			              __ATOMIC_RELAXED);
+			__atomic_load(&shm->windows[i].p90, &snap->windows[i].p90,
+			              __ATOMIC_RELAXED);
+			__atomic_load(&shm->windows[i].p99, &snap->windows[i].p99,
+			              __ATOMIC_RELAXED);
+			__atomic_load(&shm->windows[i].max, &snap->windows[i].max,
+			              __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq);
+
+	return snap->sample ? 0 : -1;
+}
+
+/*
+ * Unmap a segment mapped by cpuwatch_shm_open().
+ */
+static inline void cpuwatch_shm_close(struct cpuwatch_shm *shm)
+{
+	munmap((void *)shm, sizeof(struct cpuwatch_shm));
+}
+
+/*
+ * The stream of updates sent by cpuwatch --subscribe=PATH.
+ *
+ * A client connects a SOCK_SEQPACKET socket to PATH with cpuwatch_subscribe(),
+ * and is then sent a struct cpuwatch_update, one to a packet, as soon as each
+ * sample is taken:
+ *
+ *	int fd = cpuwatch_subscribe("/run/cpuwatch.sub");
+ *	struct cpuwatch_update u;
+ *	while (fd >= 0 && cpuwatch_update_read(fd, &u) == 0)
+ *		printf("%.1f%%\n", u.snap.util);
+ *
+ * cpuwatch never waits for a client. One which has not read the last update
+ * by the next sample skips samples until it has, and is then sent the newest,
+ * so the sample numbers tell it how many it missed. One which falls more than
+ * CPUWATCH_UPDATE_PATIENCE samples behind is disconnected.
+ */
+
+#define CPUWATCH_UPDATE_MAGIC 0x50554357 /* "WCUP" */
+#define CPUWATCH_UPDATE_PATIENCE 1024
+
+/* One update, in the byte order of the machine. */
+struct cpuwatch_update {
+	uint32_t magic;     /* CPUWATCH_UPDATE_MAGIC. */
+	uint32_t size;      /* sizeof(struct cpuwatch_update). */
+	struct cpuwatch_snapshot snap;
+};
+
+/*
+ * Connect to the stream of updates sent by cpuwatch --subscribe=PATH.
+ *
+ * Returns the socket to read updates from, or -1 with errno set.
+ */
+static inline int cpuwatch_subscribe(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Wait for the next update on a socket from cpuwatch_subscribe().
+ *
+ * Returns 0 on success, or -1 with errno set on failure, or to ECONNRESET if
+ * cpuwatch has closed the stream, or EPROTO if an update was not understood.
+ */
+static inline int cpuwatch_update_read(int fd, struct cpuwatch_update *u)
+{
+	ssize_t n;
+
+	while ((n = recv(fd, u, sizeof(*u), 0)) < 0 && errno == EINTR);
+	if (n < 0) {
+		return -1;
+	}
+	if (n == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	if ((size_t)n != sizeof(*u) || u->magic != CPUWATCH_UPDATE_MAGIC ||
+	    u->size != sizeof(*u)) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The history file written by cpuwatch --history=FILE.
+ *
+ * The file is a header of CPUWATCH_HISTORY_HEADER bytes followed by a ring of
+ * capacity records. Record number i (counting every record ever written) is
+ * kept in slot i % capacity. The writer fills in a record and then increments
+ * count, so records [count - capacity, count) are in the file. A reader which
+ * maps the file can read them while the writer carries on, using
+ * cpuwatch_history_get() to detect a record being overwritten under it.
+ *
+ * Each record holds running totals of the CPU time available and the CPU time
+ * spent working, in CPU-seconds. They carry on across restarts of cpuwatch and
+ * reboots of the system, so the utilisation between any two records i < j is:
+ *  100% * (busy[j] - busy[i]) / (avail[j] - avail[i])
+ *
+ * After the records come up to CPUWATCH_HISTORY_MAXTIERS tiers of rollups,
+ * each a ring like the records, at tiers[t].offset in the file. A rollup sums
+ * up the records in a fixed period of time (a minute, say) with their least,
+ * mean and greatest utilisation, and the running totals at its end, so a tier
+ * can keep a long history in little space. Rollup number i of tier t is read
+ * with cpuwatch_history_rollup(), and cpuwatch_history_pick() chooses the tier
+ * to answer a query from.
+ */
+
+#define CPUWATCH_HISTORY_MAGIC "CPUWHIST"
+#define CPUWATCH_HISTORY_VERSION 2
+#define CPUWATCH_HISTORY_HEADER 4096
+#define CPUWATCH_HISTORY_MAXTIERS 4
+
+struct cpuwatch_rollup {
+	int64_t start;        /* CLOCK_REALTIME at the start of the period, in ns. */
+	double avail;         /* The running totals, as in struct cpuwatch_record, */
+	double busy;          /* at the last record in the period. */
+	float min;            /* Least, mean and greatest utilisation over the */
+	float mean;           /* records in the period, in %. */
+	float max;
+	uint32_t samples;     /* Number of records in the period. */
+};
+
+struct cpuwatch_tier {
+	int64_t period;       /* Length of each period, in ns. */
+	uint64_t capacity;    /* Number of rollups in the ring. */
+	uint64_t count;       /* Number of rollups ever completed. */
+	uint64_t offset;      /* Where the ring starts in the file. */
+	double startavail;    /* The running totals at the start of the period */
+	double startbusy;     /* being filled in, */
+	struct cpuwatch_rollup open; /* and its rollup so far (for the writer). */
+};
+
+struct cpuwatch_history {
+	char magic[8];        /* CPUWATCH_HISTORY_MAGIC, without a nul. */
+	uint32_t version;     /* CPUWATCH_HISTORY_VERSION. */
+	uint32_t recsize;     /* sizeof(struct cpuwatch_record). */
+	uint64_t capacity;    /* Number of records in the ring. */
+	uint64_t count;       /* Number of records ever written. */
+	double interval;      /* Seconds between samples, as last configured. */
+	char bootid[40];      /* Boot ID of the system which last wrote. */
+	double uptime;        /* The /proc/uptime readings behind the last */
+	double idle;          /* record, to carry the totals on after a restart. */
+	uint32_t ntiers;      /* Number of tiers of rollups. */
+	uint32_t rollupsize;  /* sizeof(struct cpuwatch_rollup). */
+	struct cpuwatch_tier tiers[CPUWATCH_HISTORY_MAXTIERS];
+};
+
+struct cpuwatch_record {
+	int64_t realtime;     /* CLOCK_REALTIME of the sample, in ns. */
+	double avail;         /* Running total of CPU time available. */
+	double busy;          /* Running total of CPU time spent working. */
+	float util;           /* Utilisation since the last record, in %. */
+	float ncpu;           /* Number of CPUs at the time. */
+};
+
+/*
+ * Copy record number i from a mapped history file into rec.
+ *
+ * Returns 0 on success, or -1 if the record is not (or no longer) in the file.
+ */
+static inline int cpuwatch_history_get(const struct cpuwatch_history *h,
+                                       uint64_t i, struct cpuwatch_record *rec)
+{
+	const struct cpuwatch_record *recs = (const struct cpuwatch_record *)
+		((const char *)h + CPUWATCH_HISTORY_HEADER);
+	uint64_t cap = h->capacity;
+
+	if (i >= __atomic_load_n(&h->count, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	const struct cpuwatch_record *r = &recs[i % cap];
+	rec->realtime = __atomic_load_n(&r->realtime, __ATOMIC_RELAXED);
+	__atomic_load(&r->avail, &rec->avail, __ATOMIC_RELAXED);
+	__atomic_load(&r->busy, &rec->busy, __ATOMIC_RELAXED);
+	__atomic_load(&r->util, &rec->util, __ATOMIC_RELAXED);
+	__atomic_load(&r->ncpu, &rec->ncpu, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	/* Record i + cap reuses the slot, and is written while count is i + cap,
+	 * so the copy is good if count had not reached that. */
+	return __atomic_load_n(&h->count, __ATOMIC_RELAXED) < i + cap ? 0 : -1;
+}
+
+/*
+ * Copy rollup number i of tier t from a mapped history file into r.
+ *
+ * Returns 0 on success, or -1 if the rollup is not (or no longer) in the file.
+ */
+static inline int cpuwatch_history_rollup(const struct cpuwatch_history *h,
+                                          uint32_t t, uint64_t i,
+                                          struct cpuwatch_rollup *r)
+{
+	if (t >= h->ntiers) {
+		return -1;
+	}
+	const struct cpuwatch_tier *tier = &h->tiers[t];
+	const struct cpuwatch_rollup *ring = (const struct cpuwatch_rollup *)
+		((const char *)h + tier->offset);
+	uint64_t cap = tier->capacity;
+
+	if (i >= __atomic_load_n(&tier->count, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	const struct cpuwatch_rollup *p = &ring[i % cap];
+	r->start = __atomic_load_n(&p->start, __ATOMIC_RELAXED);
+	__atomic_load(&p->avail, &r->avail, __ATOMIC_RELAXED);
+	__atomic_load(&p->busy, &r->busy, __ATOMIC_RELAXED);
+	__atomic_load(&p->min, &r->min, __ATOMIC_RELAXED);
+	__atomic_load(&p->mean, &r->mean, __ATOMIC_RELAXED);
+	__atomic_load(&p->max, &r->max, __ATOMIC_RELAXED);
+	r->samples = __atomic_load_n(&p->samples, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&tier->count, __ATOMIC_RELAXED) < i + cap ? 0 : -1;
+}
+
+/*
+ * Find the time of the oldest record (for t = -1) or rollup of tier t still
+ * in a mapped history file.
+ *
+ * Returns 0 on success, with *when set, or -1 if there are none.
+ */
+static inline int cpuwatch_history_oldest(const struct cpuwatch_history *h,
+                                          int t, int64_t *when)
+{
+	uint64_t count, cap;
+
+	if (t < 0) {
+		struct cpuwatch_record rec;
+		count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+		cap = h->capacity;
+		/* Skip the oldest slot, which may be overwritten at any moment. */
+		if (cpuwatch_history_get(h, count > cap ? count - cap + 1 : 0,
+		                         &rec) < 0) {
+			return -1;
+		}
+		*when = rec.realtime;
+		return 0;
+	}
+
+	struct cpuwatch_rollup r;
+	count = __atomic_load_n(&h->tiers[t].count, __ATOMIC_ACQUIRE);
+	cap = h->tiers[t].capacity;
+	if (cpuwatch_history_rollup(h, t, count > cap ? count - cap + 1 : 0,
+	                            &r) < 0) {
+		return -1;
+	}
+	*when = r.start;
+	return 0;
+}
+
+/*
+ * Choose where to answer a query about the time since from (CLOCK_REALTIME,
+ * in ns) which needs a resolution of step ns: the coarsest tier whose periods
+ * are no longer than step and which still goes back to from. If none of those
+ * go back far enough, the finest tier which does; if none does, the one which
+ * goes back furthest. The fewer, longer periods of a coarse tier keep the cost
+ * of a query bounded however long a range it covers.
+ *
+ * Returns the tier, or -1 to use the records themselves.
+ */
+static inline int cpuwatch_history_pick(const struct cpuwatch_history *h,
+                                        int64_t from, int64_t step)
+{
+	int best = -2, coarse = -2, oldest = -1;
+	int64_t bestperiod = -1, coarseperiod = INT64_MAX, earliest = INT64_MAX;
+	int64_t when;
+
+	for (int t = -1; t < (int)h->ntiers; t++) {
+		int64_t period = t < 0 ? 0 : h->tiers[t].period;
+		if (cpuwatch_history_oldest(h, t, &when) < 0) {
+			continue;
+		}
+		if (when < earliest) {
+			earliest = when;
+			oldest = t;
+		}
+		if (when > from) {
+			continue;
+		}
+		if (period <= step && period > bestperiod) {
+			best = t;
+			bestperiod = period;
+		} else if (period > step && period < coarseperiod) {
+			coarse = t;
+			coarseperiod = period;
+		}
+	}
+
+	return best != -2 ? best : coarse != -2 ? coarse : oldest;
+}
+
+#endif
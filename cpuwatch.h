@@ -0,0 +1,550 @@
+/*
+ * Declarations shared between the parts of cpuwatch.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#ifndef CPUWATCH_H
+#define CPUWATCH_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The name the program was run as, for use in error messages. */
+extern char *argv0;
+
+/* The most moving averages which can be taken at once. */
+#define MAXWINDOWS 16
+
+/*
+ * output.c: writing of results to files.
+ */
+
+/* Strategies for replacing the contents of an output file. */
+enum outmode {
+	OUT_TRUNCATE,
+	OUT_RENAME,
+	OUT_PWRITE,
+	NOUTMODES
+};
+
+extern const char *const outmodenames[NOUTMODES];
+
+/* A file which results are written to. */
+struct output {
+	char *path;
+	enum outmode mode;
+	int fd;        /* The file, kept open for OUT_PWRITE. */
+	char *tmp;     /* The temporary file for OUT_RENAME. */
+	size_t width;  /* The longest length written, for OUT_PWRITE. */
+};
+
+/* A buffer which text is built up in. A buffer with fixed set uses the memory
+ * it was given and never grows; otherwise it grows as needed, and is normally
+ * reused (by setting len to 0) so that it only grows a few times. */
+struct buf {
+	char *data;
+	size_t len;
+	size_t cap;
+	int err;       /* Set if an append did not fit. */
+	int fixed;
+};
+
+int openoutput(struct output *out, char *path, enum outmode mode);
+int writeoutput(struct output *out, const char *buf, size_t len);
+int writeutil(struct output *out, double util);
+int outmodebyname(const char *name);
+void bufput(struct buf *b, const char *s, size_t len);
+void bufputs(struct buf *b, const char *s);
+void bufputu(struct buf *b, uint64_t v);
+void bufputfixed(struct buf *b, double v);
+void bufputpercent(struct buf *b, double v);
+
+/*
+ * stat.c: per-CPU time accounting from /proc/stat.
+ */
+
+/* The modes /proc/stat accounts CPU time in, in the order of its columns. */
+enum cpumode {
+	MODE_USER,
+	MODE_NICE,
+	MODE_SYSTEM,
+	MODE_IDLE,
+	MODE_IOWAIT,
+	MODE_IRQ,
+	MODE_SOFTIRQ,
+	MODE_STEAL,
+	MODE_GUEST,
+	MODE_GUESTNICE,
+	NMODES
+};
+
+extern const char *const modenames[NMODES];
+
+/* Counters for every CPU listed in /proc/stat, in clock ticks. They are
+ * stored as one array per mode so that a pass over a single mode for all
+ * CPUs touches contiguous memory. */
+struct cpustat {
+	int ncpu;                /* Number of CPUs listed. */
+	int cap;                 /* Allocated length of each array. */
+	int *id;                 /* id[i] is the number of the i'th CPU. */
+	uint64_t all[NMODES];    /* The summary line for all CPUs. */
+	uint64_t *mode[NMODES];  /* mode[m][i] is the time CPU id[i] spent in m. */
+};
+
+int parsestat(struct cpustat *st, const char *buf, size_t len);
+int statdelta(struct cpustat *delta, const struct cpustat *cur,
+              const struct cpustat *prev);
+uint64_t statbusy(const uint64_t *t, uint64_t *total);
+void renderstat(const struct cpustat *delta, struct buf *b);
+void freestat(struct cpustat *st);
+
+/*
+ * proc.c: reading of the files in /proc, live or from a capture.
+ */
+
+/* Where the contents of /proc/uptime (or /proc/schedstat) and /proc/stat come
+ * from for each sample: the files themselves (under a directory other than
+ * /proc, if asked), or the frames of a capture being replayed. */
+struct procsource {
+	char *uptimepath;      /* The files read, under the directory standing */
+	char *statpath;        /* for /proc. */
+	int uptimefd;
+	int statfd;
+	const char *uptime;    /* The latest contents of uptime, nul-terminated, */
+	size_t uptimelen;
+	const char *stat;      /* and of stat, if it was read. */
+	size_t statlen;
+	int64_t realtime;      /* CLOCK_REALTIME and CLOCK_MONOTONIC when they */
+	int64_t monotonic;     /* were read, in ns. */
+	char *uptimebuf;       /* Buffers they are read into. */
+	size_t uptimecap;
+	char *statbuf;
+	size_t statcap;
+	int capture;           /* The file frames are appended to, or -1. */
+	const char *capturepath;
+	int replaying;         /* Set if samples come from a capture, */
+	const unsigned char *replay; /* which is mapped here, */
+	size_t replaysize;
+	size_t replayoff;      /* with the next frame at this offset. */
+	const char *replaypath;
+	int highres;           /* Set if schedstat is read in place of uptime. */
+	uint64_t *runtime;     /* The time each CPU has spent running tasks, */
+	uint64_t *carry;       /* and what is still to be counted of it, in ns, */
+	size_t nruntime;       /* indexed by CPU number, */
+	int ncpu;              /* the number of CPUs listed, */
+	int64_t lastmono;      /* when it was read, */
+	double idle;           /* and the idle time worked out from it. */
+};
+
+int openproc(struct procsource *p, const char *root, int highres,
+             const char *capture, const char *replay);
+int readproc(struct procsource *p, int wantstat);
+int parseuptime(const char *buf, double *uptime, double *idletime);
+int parseschedstat(struct procsource *p, double ncpu, double *uptime,
+                   double *idletime);
+int parseseconds(const char **s, double *value);
+
+/*
+ * tick.c: scheduling of samples on absolute deadlines.
+ */
+
+/* A schedule of deadlines at which samples are taken. */
+struct tick {
+	int64_t next;           /* The next deadline on CLOCK_MONOTONIC, in ns. */
+	int64_t period;         /* Nanoseconds between deadlines. */
+	unsigned long overruns; /* Number of deadlines missed so far. */
+	unsigned long warnat;   /* Overruns at which to next print a warning. */
+	volatile sig_atomic_t *stop; /* If not NULL, a flag which a signal handler
+	                              * sets to cut the wait short. */
+	int64_t late;           /* How long after the deadline the last wait
+	                         * ended, in ns. */
+};
+
+int tickinit(struct tick *t, double interval);
+int tickwait(struct tick *t);
+int monotime(int64_t *ns);
+int walltime(int64_t *ns);
+
+/*
+ * writer.c: writer threads, which write output files.
+ */
+
+#define WRITER_QUEUE 64 /* Outputs which can wait for each writer. */
+
+/* The text to be written to an output. */
+struct writejob {
+	struct output *out;
+	struct buf text;
+};
+
+/* A thread which writes the outputs handed to it, in order. */
+struct writer {
+	pthread_t thread;
+	struct writejob jobs[WRITER_QUEUE];
+	size_t head;             /* Jobs published by the sampling loop, */
+	size_t tail;             /* and written, which wrap around jobs. */
+	sem_t ready;             /* Posted for each job published. */
+	int stopping;            /* Set to stop once the queue is empty. */
+	int failed;              /* Set if a write failed. */
+	unsigned long overflows; /* Outputs dropped as the queue was full. */
+	unsigned long warnat;    /* Overflows at which to next warn. */
+};
+
+/* The writers outputs are shared between, if any. */
+struct writers {
+	struct writer *w;
+	int n;
+	int block;               /* Set to wait rather than drop outputs. */
+	struct buf local;        /* The text being built, if there are none. */
+};
+
+int startwriters(struct writers *ws, int n, int block);
+struct buf *outputbegin(struct writers *ws, int i, struct output *out);
+int outputend(struct writers *ws, int i, struct output *out, struct buf *b);
+int writersfailed(const struct writers *ws);
+unsigned long outputoverflows(const struct writers *ws);
+int stopwriters(struct writers *ws);
+
+/*
+ * metrics.c: rendering of samples as Prometheus metrics.
+ */
+
+struct cpuwatch_snapshot;
+struct cgroup;
+struct window;
+
+/* What is worked out once to render metrics for each sample. */
+struct metrics {
+	char windows[MAXWINDOWS][64];   /* The labels for each window, */
+	char pcts[MAXWINDOWS][64];      /* and with a percentile to follow, or
+	                                 * "" if it has no percentiles. */
+	int percentiles;                /* Set if any window has them. */
+	long hz;                        /* Clock ticks in a second. */
+};
+
+void initmetrics(struct metrics *m, const struct cpuwatch_snapshot *snap,
+                 const struct window *windows);
+void rendermetrics(const struct metrics *m,
+                   const struct cpuwatch_snapshot *snap,
+                   const struct cpustat *st, const struct cgroup *cgroups,
+                   int ncgroups, struct buf *b);
+
+/*
+ * server.c: a server answering queries, sending updates and serving metrics.
+ */
+
+struct cpuwatch_update;
+
+/* What the server knows of the latest sample, rendered for each kind of
+ * client. */
+struct view {
+	struct buf util;        /* Each average, after its length, */
+	struct buf cpus;        /* and each CPU, as for --stat, */
+	struct buf metrics;     /* and as metrics for HTTP, */
+	struct cpuwatch_update *update; /* and an update for subscribers. */
+};
+
+struct client;
+
+/* A server on Unix sockets and a local TCP port, run by a thread of its
+ * own. */
+struct server {
+	const char *querypath;  /* Where queries and subscriptions are taken, */
+	const char *subpath;    /* or NULL. */
+	const struct cpuwatch_history *history; /* For ranges, or NULL. */
+	pthread_t thread;
+	int running;
+	int stopping;           /* Set to stop the thread. */
+	int listen;             /* The sockets clients connect to, */
+	int sublisten;
+	int httplisten;
+	int epoll;              /* what the thread waits on, */
+	int wake;               /* an eventfd to wake it, */
+	int spare;              /* and a descriptor to give up if out of them. */
+	struct client *clients;
+	struct client *subscribers;
+	struct client *dropped; /* Clients closed but not yet freed. */
+	int nsubscribers;
+	struct view views[3];   /* The views of the latest sample: */
+	int back;               /* being rendered by the sampling loop, */
+	int middle;             /* handed over (with VIEW_FRESH if newer), */
+	int front;              /* and being read by the server. */
+	int seen;               /* Set once the server has taken a view. */
+};
+
+int startserver(struct server *srv, const char *querypath,
+                const char *subpath, int httpport,
+                const struct cpuwatch_history *h);
+struct view *backview(struct server *srv);
+void publishview(struct server *srv);
+void stopserver(struct server *srv);
+
+/*
+ * self.c: measurement of what cpuwatch itself costs.
+ */
+
+/* The stages of taking a sample, which are timed separately. */
+enum stage {
+	STAGE_READ,     /* Reading /proc. */
+	STAGE_PARSE,    /* Parsing what was read. */
+	STAGE_COMPUTE,  /* Working out averages and the like. */
+	STAGE_WRITE,    /* Writing outputs, history and so on. */
+	NSTAGES
+};
+
+extern const char *const stagenames[NSTAGES];
+
+#define NLATE 22 /* Buckets of wakeup lateness: < 1us, < 2us ... >= 1s. */
+
+/* Figures about cpuwatch's own running. */
+struct selfstats {
+	int64_t started;            /* CLOCK_MONOTONIC when it started. */
+	int64_t mark;               /* When the current stage started. */
+	unsigned long samples;      /* Samples taken. */
+	int64_t stage[NSTAGES];     /* Total time spent in each stage, in ns. */
+	unsigned long wakeups;      /* Wakeups for samples, */
+	unsigned long late[NLATE];  /* a histogram of how late they were, */
+	int64_t latesum;            /* and the total */
+	int64_t latemax;            /* and greatest lateness, in ns. */
+};
+
+void selfinit(struct selfstats *self);
+void selfwake(struct selfstats *self, int64_t late);
+void selfstage(struct selfstats *self, enum stage stage);
+void selfreport(struct selfstats *self, struct buf *b, unsigned long overruns,
+                unsigned long overflows);
+
+/*
+ * cpus.c: detection of the number of CPUs available.
+ */
+
+/* The CPUs available to the system and to this process. */
+struct cpuinfo {
+	int online;      /* CPUs online in the system. */
+	int affinity;    /* CPUs this process may run on, or 0 if unknown. */
+	double quota;    /* CPUs' worth of time allowed by cgroup cpu.max, or 0. */
+	double capacity; /* The smallest of the above. */
+};
+
+int readcpus(struct cpuinfo *ci);
+double readcpumax(const char *path);
+double parsecpumax(const char *c);
+
+/*
+ * cgroup.c: per-cgroup CPU usage from cgroup version 2.
+ */
+
+/* The most cgroups which can be watched at once. */
+#define MAXCGROUPS 16
+
+/* Counters from a cgroup's cpu.stat, in microseconds or periods. */
+struct cgroupstat {
+	uint64_t usage;
+	uint64_t user;
+	uint64_t system;
+	uint64_t nrthrottled;
+	uint64_t throttled;
+};
+
+/* A cgroup being watched. */
+struct cgroup {
+	const char *path;       /* As given. */
+	char *label;            /* The label for its metrics, cgroup="PATH". */
+	char *dirpath;          /* Where its directory was found, */
+	uint64_t dev;           /* and the device and inode of the directory, */
+	uint64_t ino;           /* to notice it being replaced. */
+	int dir;                /* Its directory, and cpu.stat and cpu.max in */
+	int statfd;             /* it, kept open while it is present, though */
+	int maxfd;              /* the root has no cpu.max. */
+	int present;            /* Set while its files are open, */
+	int primed;             /* once they have been read, */
+	int ready;              /* and once there is a figure for an interval. */
+	int64_t at;             /* When they were last read, in ns. */
+	struct cgroupstat cur;  /* The counters last read, */
+	struct cgroupstat delta;/* and how they moved over the last interval. */
+	double limit;           /* CPUs' worth of time allowed by cpu.max. */
+	double util;            /* Usage over the last interval as a percentage */
+	double userutil;        /* of the limit, and the same split into user */
+	double systemutil;      /* and system time. */
+};
+
+int opencgroup(struct cgroup *cg, const char *path);
+void readcgroup(struct cgroup *cg, double ncpu);
+void rendercgroup(const struct cgroup *cg, struct buf *b);
+void closecgroup(struct cgroup *cg);
+
+/*
+ * shm.c: publication of samples in POSIX shared memory.
+ */
+
+struct cpuwatch_shm;
+struct cpuwatch_snapshot;
+
+struct cpuwatch_shm *openshm(const char *name);
+void publishshm(struct cpuwatch_shm *shm, const struct cpuwatch_snapshot *snap);
+
+/*
+ * hist.c: histograms of utilisation, for percentiles over a window.
+ */
+
+#define HISTBUCKETS 1001 /* 0% to 100% in steps of 0.1%. */
+#define HISTGROUP 32     /* Buckets in each group. */
+
+/* A histogram of utilisation, with a count of the values in each bucket and
+ * in each group of HISTGROUP buckets. Adding and removing a value is O(1), and
+ * finding a percentile means summing at most a few dozen counts. */
+struct hist {
+	uint32_t count[HISTBUCKETS];
+	uint32_t group[(HISTBUCKETS + HISTGROUP - 1) / HISTGROUP];
+	uint32_t total;
+};
+
+void histclear(struct hist *h);
+void histadd(struct hist *h, double util);
+void histremove(struct hist *h, double util);
+double histquantile(const struct hist *h, double q);
+
+/*
+ * window.c: moving averages over the history of samples.
+ */
+
+/* A single reading of the system uptime and the total idle time, with the
+ * total CPU time which has been available: the sum over each interval of its
+ * length multiplied by the number of CPUs at the time. */
+struct sample {
+	double uptime;
+	double idle;
+	double total;
+};
+
+/* A ring buffer holding the most recent samples. */
+struct ring {
+	struct sample *buf;
+	size_t size;  /* Capacity of buf. */
+	size_t head;  /* Index at which the next sample is stored. */
+	size_t count; /* Number of samples stored so far, at most size. */
+};
+
+/* A moving average of the utilisation, and where to write it. */
+struct window {
+	int samples;       /* Length of the window in samples. */
+	double halflife;   /* If not 0, the average is exponentially weighted,
+	                    * with this half-life in seconds, and samples is 1. */
+	double util;       /* The latest average, as a percentage. */
+	struct hist *hist; /* If not NULL, the utilisation over each interval
+	                    * in the window, for percentiles. */
+	double p50;        /* Percentiles of the utilisation over each */
+	double p90;        /* interval in the window, if hist is not NULL. */
+	double p99;
+	double max;
+	struct output out;
+	double threshold;  /* If not negative, only write when a figure moves by
+	                    * more than this many points from what was last */
+	int64_t heartbeat; /* written, or when this many ns have passed, if not
+	                    * 0. */
+	double shown[5];   /* The figures last written, */
+	int64_t shownat;   /* and when, on CLOCK_MONOTONIC in ns. */
+	int written;       /* Set once anything has been written. */
+};
+
+int ringinit(struct ring *ring, size_t size);
+void ringpush(struct ring *ring, const struct sample *s);
+const struct sample *ringago(const struct ring *ring, size_t ago);
+void initwindow(struct window *w, const struct sample *s);
+void updatewindow(struct window *w, const struct ring *ring);
+int windowchanged(struct window *w, int64_t now);
+void renderwindow(const struct window *w, struct buf *b);
+
+/*
+ * history.c: a memory-mapped ring file holding the history of samples.
+ */
+
+struct cpuwatch_history;
+struct cpuwatch_record;
+
+/* A tier of rollups to keep in a history file: how long a period each
+ * summarises, and how many to keep. */
+struct tierspec {
+	double seconds;
+	uint64_t capacity;
+};
+
+/* A history file, mapped into memory. */
+struct history {
+	struct cpuwatch_history *hdr;
+	struct cpuwatch_record *recs;
+	size_t size;          /* Size of the mapping. */
+	int fd;               /* The file, kept open to hold its lock. */
+	int sameboot;         /* Set if the last record was written this boot. */
+	int started;          /* Set once this process has written a record. */
+	struct sample last;   /* The sample behind this process's last record. */
+	unsigned unsynced;    /* Records written since the last msync. */
+};
+
+int openhistory(struct history *h, const char *path, uint64_t capacity,
+                const struct tierspec *tiers, int ntiers, double interval);
+void recordhistory(struct history *h, const struct sample *s, double ncpu,
+                   int64_t realtime);
+void closehistory(struct history *h);
+
+/*
+ * query.c: queries of the utilisation over a range of time from a history file.
+ */
+
+int parsetime(const char **s, int64_t *ns);
+int queryhistory(const struct cpuwatch_history *h, int64_t from, int64_t to,
+                 double *util);
+int querycmd(int argc, char **argv);
+
+/*
+ * record.c: compressed recording of the per-CPU counters from /proc/stat.
+ */
+
+/* A stream of bits being built up, most significant first. */
+struct bitwriter {
+	struct buf out;
+	uint64_t acc;   /* Bits not yet appended to out. */
+	int nbits;      /* Number of bits in acc. */
+};
+
+/* A stream of bits being read. */
+struct bitreader {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t acc;   /* Bits read from p but not yet used, at the top. */
+	int nbits;      /* Number of bits in acc. */
+	int overrun;    /* Set if the stream ran out. */
+};
+
+/* A recording file, and the block of samples being built up for it. */
+struct record {
+	const char *path;
+	int fd;
+	struct bitwriter bits;
+	uint32_t points;   /* Samples in the current block. */
+	int ncpu;          /* Number of CPUs in the current block. */
+	int cap;           /* Allocated length of id, and of last / NMODES / 2. */
+	int *id;           /* The numbers of the CPUs in the current block. */
+	uint64_t *last;    /* The last value of each counter, then its delta. */
+	int64_t first;     /* Time of the first sample in the block, in us. */
+	int64_t lasttime;  /* Time of the last sample, in us. */
+	int64_t timedelta; /* Time between the last two samples, in us. */
+};
+
+int openrecord(struct record *r, const char *path);
+int recordstat(struct record *r, const struct cpustat *st, int64_t realtime);
+int flushrecord(struct record *r);
+ssize_t decodeblock(const unsigned char *buf, size_t len, struct cpustat *st,
+                    int (*fn)(int64_t t, const struct cpustat *st, void *arg),
+                    void *arg);
+int decodecmd(int argc, char **argv);
+uint64_t getbits(struct bitreader *r, int n);
+int64_t getint(struct bitreader *r);
+
+#endif
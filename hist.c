@@ -0,0 +1,90 @@
+/*
+ * Histograms of utilisation, for percentiles over a window.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "cpuwatch.h"
+
+/*
+ * Return the bucket a utilisation falls in. Values outside 0-100% (which can
+ * happen if the number of CPUs is given wrongly) go in the end buckets.
+ */
+static int histbucket(double util)
+{
+	if (!(util > 0)) {
+		return 0;
+	}
+	if (util >= 100) {
+		return HISTBUCKETS - 1;
+	}
+	return (int)lround(util * 10);
+}
+
+/*
+ * Empty the histogram.
+ */
+void histclear(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Count a utilisation in the histogram.
+ */
+void histadd(struct hist *h, double util)
+{
+	int b = histbucket(util);
+	h->count[b]++;
+	h->group[b / HISTGROUP]++;
+	h->total++;
+}
+
+/*
+ * Remove a utilisation which was counted earlier from the histogram. It must
+ * be exactly the value which was added, so that it comes out of the same
+ * bucket.
+ */
+void histremove(struct hist *h, double util)
+{
+	int b = histbucket(util);
+	h->count[b]--;
+	h->group[b / HISTGROUP]--;
+	h->total--;
+}
+
+/*
+ * Return the q'th quantile (0 < q <= 1) of the values in the histogram, to the
+ * nearest 0.1%: the smallest value which at least q of the values are less
+ * than or equal to. The counts of each group of buckets are searched first,
+ * then the buckets in the group, so this looks at no more than a few dozen
+ * counts.
+ *
+ * Returns the quantile, or NAN if the histogram is empty.
+ */
+double histquantile(const struct hist *h, double q)
+{
+	if (!h->total) {
+		return NAN;
+	}
+
+	uint32_t rank = (uint32_t)ceil(q * h->total);
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	uint32_t seen = 0;
+	int g = 0;
+	while (seen + h->group[g] < rank) {
+		seen += h->group[g++];
+	}
+	int b = g * HISTGROUP;
+	while (seen + h->count[b] < rank) {
+		seen += h->count[b++];
+	}
+	return b / 10.0;
+}
@@ -0,0 +1,337 @@
+/*
+ * A memory-mapped ring file holding the history of samples.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+#include "cpuwatch-client.h"
+
+/* How many records to write between calls to msync. */
+#define HISTORY_SYNC 1024
+
+_Static_assert(sizeof(struct cpuwatch_history) <= CPUWATCH_HISTORY_HEADER,
+               "the history header must fit in its space in the file");
+
+static void addrollup(struct cpuwatch_history *hdr, struct cpuwatch_tier *t,
+                      const struct cpuwatch_record *rec, double avail,
+                      double busy);
+static int sametiers(const struct cpuwatch_history *hdr,
+                     const struct cpuwatch_tier *layout, int ntiers);
+static void readbootid(char *id, size_t size);
+
+/*
+ * Open the history file at path, creating it with room for capacity records
+ * and the ntiers tiers of rollups given if it does not exist, and map it into
+ * memory. The layout is described in cpuwatch-client.h.
+ *
+ * An existing file is carried on from where it was left, so history survives
+ * restarts, as long as it was made with the same capacity and tiers.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int openhistory(struct history *h, const char *path, uint64_t capacity,
+                const struct tierspec *tiers, int ntiers, double interval)
+{
+	struct cpuwatch_tier layout[CPUWATCH_HISTORY_MAXTIERS];
+
+	memset(h, 0, sizeof(*h));
+
+	if (capacity == 0 || capacity > (SIZE_MAX - CPUWATCH_HISTORY_HEADER) /
+	                                 sizeof(struct cpuwatch_record)) {
+		fprintf(stderr, "%s: Cannot keep %llu records of history\n",
+		        argv0, (unsigned long long)capacity);
+		errno = EINVAL;
+		return -1;
+	}
+	size_t size = CPUWATCH_HISTORY_HEADER +
+	              capacity * sizeof(struct cpuwatch_record);
+
+	/* The tiers of rollups follow the records, in the order given. */
+	for (int t = 0; t < ntiers; t++) {
+		uint64_t cap = tiers[t].capacity;
+		int64_t period = llround(tiers[t].seconds * 1e9);
+		if (cap == 0 || period <= 0 ||
+		    cap > (SIZE_MAX - size) / sizeof(struct cpuwatch_rollup)) {
+			fprintf(stderr, "%s: Cannot keep %llu rollups of %g seconds\n",
+			        argv0, (unsigned long long)cap, tiers[t].seconds);
+			errno = EINVAL;
+			return -1;
+		}
+		memset(&layout[t], 0, sizeof(layout[t]));
+		layout[t].period = period;
+		layout[t].capacity = cap;
+		layout[t].offset = size;
+		size += cap * sizeof(struct cpuwatch_rollup);
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+		        argv0, path, strerror(errno));
+		return -1;
+	}
+
+	/* Only one cpuwatch may write to the ring at once, or their records
+	 * would be torn. The lock is held for as long as the file is open. */
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		int err = errno;
+		if (err == EWOULDBLOCK) {
+			fprintf(stderr, "%s: '%s' is already in use by another "
+			        "cpuwatch\n", argv0, path);
+		} else {
+			fprintf(stderr, "%s: Could not lock '%s' (%s)\n",
+			        argv0, path, strerror(err));
+		}
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		goto fail;
+	}
+	int created = st.st_size == 0;
+	if (created && ftruncate(fd, size) < 0) {
+		goto fail;
+	}
+	if (!created && (size_t)st.st_size != size) {
+		fprintf(stderr, "%s: '%s' is %lld bytes, but should be %zu for %llu "
+		        "records and the rollups asked for. Give the --history-size "
+		        "and --rollup it was made with, or remove it.\n", argv0,
+		        path, (long long)st.st_size, size,
+		        (unsigned long long)capacity);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		goto fail;
+	}
+
+	struct cpuwatch_history *hdr = p;
+	if (created) {
+		memcpy(hdr->magic, CPUWATCH_HISTORY_MAGIC, sizeof(hdr->magic));
+		hdr->version = CPUWATCH_HISTORY_VERSION;
+		hdr->recsize = sizeof(struct cpuwatch_record);
+		hdr->capacity = capacity;
+		hdr->rollupsize = sizeof(struct cpuwatch_rollup);
+		hdr->ntiers = ntiers;
+		memcpy(hdr->tiers, layout, ntiers * sizeof(*layout));
+	} else if (memcmp(hdr->magic, CPUWATCH_HISTORY_MAGIC, sizeof(hdr->magic)) ||
+	           hdr->version != CPUWATCH_HISTORY_VERSION ||
+	           hdr->recsize != sizeof(struct cpuwatch_record) ||
+	           hdr->rollupsize != sizeof(struct cpuwatch_rollup) ||
+	           hdr->capacity != capacity || !sametiers(hdr, layout, ntiers)) {
+		fprintf(stderr, "%s: '%s' is not a history file written by this "
+		        "version of cpuwatch\n", argv0, path);
+		munmap(p, size);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* If the system has rebooted since the last record, the uptime and
+	 * idle time have started again from 0. */
+	char bootid[sizeof(hdr->bootid)];
+	readbootid(bootid, sizeof(bootid));
+	h->sameboot = hdr->count && bootid[0] && !strcmp(bootid, hdr->bootid);
+	memcpy(hdr->bootid, bootid, sizeof(bootid));
+	hdr->interval = interval;
+
+	h->hdr = hdr;
+	h->recs = (struct cpuwatch_record *)((char *)p + CPUWATCH_HISTORY_HEADER);
+	h->size = size;
+	h->fd = fd;
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: Could not map '%s' (%s)\n",
+	        argv0, path, strerror(errno));
+	close(fd);
+	return -1;
+}
+
+/*
+ * Append a record for the sample s, taken at the given time, to the history.
+ *
+ * The running totals carry on from the last record in the file. Between two
+ * samples taken by this process the difference is taken from the samples.
+ * For the first sample, if the last record was written since the system last
+ * booted, the difference is taken from the /proc/uptime readings saved with
+ * it; if not, the time since boot is added.
+ *
+ * Each tier of rollups is brought up to date with the record as well, so
+ * they are kept without ever going back over the records.
+ *
+ * This only writes to memory, apart from an msync every HISTORY_SYNC records.
+ */
+void recordhistory(struct history *h, const struct sample *s, double ncpu,
+                   int64_t realtime)
+{
+	struct cpuwatch_history *hdr = h->hdr;
+	uint64_t count = hdr->count;
+	double avail, idle;
+
+	if (h->started) {
+		avail = s->total - h->last.total;
+		idle = s->idle - h->last.idle;
+	} else if (h->sameboot && s->uptime >= hdr->uptime) {
+		avail = (s->uptime - hdr->uptime) * ncpu;
+		idle = s->idle - hdr->idle;
+	} else {
+		avail = s->uptime * ncpu;
+		idle = s->idle;
+	}
+	h->started = 1;
+	h->last = *s;
+
+	struct cpuwatch_record rec = { 0 };
+	if (count) {
+		rec = h->recs[(count - 1) % hdr->capacity];
+	}
+	rec.realtime = realtime;
+	rec.avail += avail;
+	rec.busy += avail - idle;
+	rec.util = avail > 0 ? 100 * (avail - idle) / avail : 0;
+	rec.ncpu = ncpu;
+
+	/* Fill in the record before making it visible to readers by
+	 * incrementing count. */
+	struct cpuwatch_record *r = &h->recs[count % hdr->capacity];
+	__atomic_store_n(&r->realtime, rec.realtime, __ATOMIC_RELAXED);
+	__atomic_store(&r->avail, &rec.avail, __ATOMIC_RELAXED);
+	__atomic_store(&r->busy, &rec.busy, __ATOMIC_RELAXED);
+	__atomic_store(&r->util, &rec.util, __ATOMIC_RELAXED);
+	__atomic_store(&r->ncpu, &rec.ncpu, __ATOMIC_RELAXED);
+	hdr->uptime = s->uptime;
+	hdr->idle = s->idle;
+	__atomic_store_n(&hdr->count, count + 1, __ATOMIC_RELEASE);
+
+	for (uint32_t t = 0; t < hdr->ntiers; t++) {
+		addrollup(hdr, &hdr->tiers[t], &rec, avail, avail - idle);
+	}
+
+	if (++h->unsynced >= HISTORY_SYNC) {
+		msync(hdr, h->size, MS_ASYNC);
+		h->unsynced = 0;
+	}
+}
+
+/*
+ * Add the record rec, which added avail and busy to the running totals, to
+ * the rollup being filled in for a tier. If the record falls in a later period
+ * (or, if the clock has been set back, an earlier one), the rollup is complete
+ * and is added to the tier's ring first.
+ */
+static void addrollup(struct cpuwatch_history *hdr, struct cpuwatch_tier *t,
+                      const struct cpuwatch_record *rec, double avail,
+                      double busy)
+{
+	struct cpuwatch_rollup *o = &t->open;
+	int64_t start = rec->realtime -
+	                (rec->realtime % t->period + t->period) % t->period;
+
+	if (o->samples && o->start != start) {
+		struct cpuwatch_rollup *ring = (struct cpuwatch_rollup *)
+			((char *)hdr + t->offset);
+		struct cpuwatch_rollup *r = &ring[t->count % t->capacity];
+		__atomic_store_n(&r->start, o->start, __ATOMIC_RELAXED);
+		__atomic_store(&r->avail, &o->avail, __ATOMIC_RELAXED);
+		__atomic_store(&r->busy, &o->busy, __ATOMIC_RELAXED);
+		__atomic_store(&r->min, &o->min, __ATOMIC_RELAXED);
+		__atomic_store(&r->mean, &o->mean, __ATOMIC_RELAXED);
+		__atomic_store(&r->max, &o->max, __ATOMIC_RELAXED);
+		__atomic_store_n(&r->samples, o->samples, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->count, t->count + 1, __ATOMIC_RELEASE);
+		o->samples = 0;
+	}
+
+	if (!o->samples) {
+		o->start = start;
+		o->min = rec->util;
+		o->max = rec->util;
+		t->startavail = rec->avail - avail;
+		t->startbusy = rec->busy - busy;
+	}
+	o->samples++;
+	if (rec->util < o->min) {
+		o->min = rec->util;
+	}
+	if (rec->util > o->max) {
+		o->max = rec->util;
+	}
+	o->avail = rec->avail;
+	o->busy = rec->busy;
+	double total = o->avail - t->startavail;
+	o->mean = total > 0 ? 100 * (o->busy - t->startbusy) / total : 0;
+}
+
+/*
+ * Check that the tiers of rollups in an existing file are laid out as the
+ * ntiers in layout are.
+ *
+ * Returns 1 if they are, or 0 if not.
+ */
+static int sametiers(const struct cpuwatch_history *hdr,
+                     const struct cpuwatch_tier *layout, int ntiers)
+{
+	if (hdr->ntiers != (uint32_t)ntiers) {
+		return 0;
+	}
+	for (int t = 0; t < ntiers; t++) {
+		if (hdr->tiers[t].period != layout[t].period ||
+		    hdr->tiers[t].capacity != layout[t].capacity ||
+		    hdr->tiers[t].offset != layout[t].offset) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Write the history out to the file and unmap it, on the way out.
+ */
+void closehistory(struct history *h)
+{
+	msync(h->hdr, h->size, MS_SYNC);
+	munmap(h->hdr, h->size);
+	close(h->fd);
+	h->hdr = NULL;
+}
+
+/*
+ * Read the boot ID of the system, which changes each time it boots, into id.
+ * If it cannot be read, id is set to an empty string.
+ */
+static void readbootid(char *id, size_t size)
+{
+	id[0] = '\0';
+
+	int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	ssize_t n = read(fd, id, size - 1);
+	close(fd);
+	if (n <= 0) {
+		n = 0;
+	}
+	id[n] = '\0';
+	id[strcspn(id, "\n")] = '\0';
+}
@@ -23,42 +23,169 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "cpuwatch.h"
+#include "cpuwatch-client.h"
+
+/* Values for long options without a short form. */
+#define OPT_TIMECONSTANT 256
+#define OPT_HISTORYSIZE 257
+#define OPT_ROLLUP 258
+#define OPT_PROCROOT 259
+#define OPT_CAPTURE 260
+#define OPT_REPLAY 261
+#define OPT_SELFSTATS 262
+#define OPT_HIGHRES 263
+#define OPT_THRESHOLD 264
+#define OPT_HEARTBEAT 265
+#define OPT_WRITERS 266
+#define OPT_SOCKET 267
+#define OPT_SUBSCRIBE 268
+#define OPT_HTTP 269
+#define OPT_PROM 270
+#define OPT_CGROUP 271
+#define OPT_CGROUPSTAT 272
+
 /* Structure to store command line options.
  * Populated in a call to parseCmdLine. */
 struct options {
-	char *output;
+	char *output[MAXWINDOWS];
+	int noutput;
+	char *stat;
+	char *shm;
+	char *history;
+	unsigned long long historysize;
+	struct tierspec rollup[CPUWATCH_HISTORY_MAXTIERS];
+	int nrollup;
+	char *record;
+	char *procroot;
+	char *capture;
+	char *replay;
+	char *selfstats;
+	char *socket;
+	char *subscribe;
+	char *prom;
+	char *cgroup[MAXCGROUPS];
+	int ncgroup;
+	char *cgroupstat;
+	enum outmode mode;
+	int percentiles;
+	int highres;
+	double threshold;
+	double heartbeat;
+	int writers;
+	int http;
 	double interval;
 	int ncpu;
-	int avg;
+	int avg[MAXWINDOWS];
+	double halflife[MAXWINDOWS];
+	int navg;
 
 	int given_h : 1;
 };
 
-int readuptime(double *uptime, double *idletime);
-int writeutil(double util, char *path);
+int takesample(struct procsource *p, int wantstat, double ncpu,
+               struct sample *s, struct cpustat *st, struct selfstats *self);
+int parsedecimal(const char *c, double *d);
+int parsecount(const char *c, unsigned long long *n);
+int parserollup(const char *c, struct tierspec *tier);
 int parseCmdLine(int argc, char **argv, struct options *options);
 char *argv0;
 
+/* Set by signal handlers to ask the main loop to finish up and exit, and to
+ * report on its own running. */
+static volatile sig_atomic_t stopping;
+static volatile sig_atomic_t reporting;
+static void stop(int sig);
+static void report(int sig);
+
 const char *usage =
-"\nusage: cpuwatch <--output=PATH> <--cpus=NUM> [options]\n\n"
+"\nusage: cpuwatch <--output=PATH> [options]\n"
+"       cpuwatch decode <FILE>\n"
+"       cpuwatch query <FILE> [FROM TO]\n\n"
 "Options:\n"
 " -h, --help                 Displays this usage statement.\n"
 " -o <PATH>, --output=PATH   The CPU utilisation should be written to PATH.\n"
-" -c <NUM>, --cpus=NUM       Number of CPUs on the system.\n"
+"                            May be given more than once, once for each -n.\n"
+" -c <NUM>, --cpus=NUM       Number of CPUs on the system. DEFAULT=the number\n"
+"                            of CPUs online, checked at every sample.\n"
 " -n <NUM>, --samples=NUM    Take a moving average of NUM samples. DEFAULT=1\n"
+"                            May be given more than once, once for each -o.\n"
+" -e <NUM>, --half-life=NUM  Take an exponentially-weighted moving average\n"
+"                            with a half-life of NUM seconds instead of -n.\n"
+" --time-constant=NUM        As -e, giving the time constant in seconds.\n"
+" -p, --percentiles          Also write the 50th, 90th and 99th percentiles\n"
+"                            and the maximum over the intervals in each -n\n"
+"                            window.\n"
 " -i <NUM>, --interval=NUM   Number of seconds between samples. DEFAULT=1\n"
+" --high-res                 Take the time CPUs spend running tasks from\n"
+"                            /proc/schedstat, in ns, instead of the idle time\n"
+"                            from /proc/uptime, in 10ms, for intervals of a\n"
+"                            few ms.\n"
+" --threshold=POINTS         Only write -o files when a figure has moved by\n"
+"                            more than this many percentage points since it\n"
+"                            was last written,\n"
+" --heartbeat=SECONDS        or when this long has passed. DEFAULT=60, or 0\n"
+"                            to never write only because time has passed.\n"
+" --socket=PATH              Answer queries on a Unix socket at PATH: util,\n"
+"                            cpus, range FROM TO, or help, one to a line.\n"
+" --subscribe=PATH           Send each sample to every client of a Unix\n"
+"                            seqpacket socket at PATH. See cpuwatch-client.h.\n"
+" --http=PORT                Serve Prometheus metrics at /metrics over HTTP\n"
+"                            on PORT of the loopback interface.\n"
+" --writers=NUM              Write output files from this many threads, so a\n"
+"                            slow file cannot delay sampling. DEFAULT=0\n"
+" -s <PATH>, --stat=PATH     Also write per-CPU utilisation from /proc/stat\n"
+"                            to PATH.\n"
+" --prom=PATH                Also write Prometheus metrics to PATH, for\n"
+"                            node_exporter's textfile collector.\n"
+" --cgroup=PATH              Also watch the CPU usage of the cgroup (v2) at\n"
+"                            PATH, relative to its limit. May be given up to\n"
+"                            16 times.\n"
+" --cgroup-stat=PATH         Write the usage of each --cgroup to PATH.\n"
+" -m <NAME>, --shm=NAME      Also publish the utilisation in the POSIX shared\n"
+"                            memory segment NAME. See cpuwatch-client.h.\n"
+" -H <PATH>, --history=PATH  Also record every sample in the history file\n"
+"                            PATH, which keeps the latest records.\n"
+" --history-size=NUM         Keep NUM records in the history file.\n"
+"                            DEFAULT=86400\n"
+" --rollup=SECS:NUM          Also keep in the history file NUM rollups (least,\n"
+"                            mean and greatest utilisation) of SECS seconds\n"
+"                            each. May be given up to 4 times, or as 'none'.\n"
+"                            DEFAULT=60:1440 and 3600:8760\n"
+" -r <PATH>, --record=PATH   Also append every sample of the per-CPU counters\n"
+"                            from /proc/stat to PATH, compressed. Print them\n"
+"                            with 'cpuwatch decode PATH'.\n"
+" --proc-root=DIR            Read uptime and stat from DIR instead of /proc,\n"
+"                            counting the CPUs listed in DIR/stat.\n"
+" --capture=PATH             Also append what is read from /proc for every\n"
+"                            sample to PATH, for --replay.\n"
+" --replay=PATH              Take samples from a file made with --capture,\n"
+"                            as fast as possible, then exit.\n"
+" --self-stats=PATH          Also write figures about cpuwatch's own running\n"
+"                            to PATH after every sample. They are written to\n"
+"                            stderr on SIGUSR1 in any case.\n"
+" -w <MODE>, --write=MODE    How to replace the contents of output files:\n"
+"                            truncate, rename or pwrite. DEFAULT=truncate\n"
 "\nExamples:\n"
 "cpuwatch -o output -i1 -n5 -c4\n"
 "  Writes to the file 'output' every 1 second a 5*1 second moving average\n"
 "  for a 4-core system.\n"
-"cpuwatch -o output -i60 -c12\n"
+"cpuwatch -o out1 -n1 -o out10 -n10 -o out60 -n60\n"
+"  Writes every second the 1, 10 and 60 second moving averages to the files\n"
+"  'out1', 'out10' and 'out60'.\n"
+"cpuwatch -o output -i60\n"
 "  Writes to the file 'output' every 60 seconds the average CPU utilisation\n"
-"  for the previous 60 seconds assuming the system has 12 cores.\n\n";
+"  for the previous 60 seconds.\n\n";
 
 /*
  * Parse the command line and begin reporting CPU utilisation.
@@ -76,12 +203,28 @@ const char *usage =
  * As the idle time is given as the sum across all CPUs, we must divide the
  * idle time by the number of CPUs:
  *  u = 100% - ((NEWUP - OLDUP) / ((NEWIDLE - OLDIDLE) / NCPU ))
+ * The number of CPUs online can change while we run, so rather than dividing
+ * by the current number we keep a running total of the CPU time available,
+ * TOTAL, adding the length of each interval multiplied by the number of CPUs
+ * online during it. Then:
+ *  u = 100% - ((NEWIDLE - OLDIDLE) / (NEWTOTAL - OLDTOTAL))
  *
  * The program continues in a loop until it is stopped by a signal or faults in
- * some way (in which case it exits with code -1).
+ * some way (in which case it exits with code -1). On SIGINT or SIGTERM it
+ * finishes writing the history and recording files and exits with code 0. On
+ * SIGUSR1 it reports on its own running to stderr.
  */
 int main(int argc, char** argv)
 {
+	if (argc > 1 && !strcmp(argv[1], "decode")) {
+		argv0 = argv[0];
+		return decodecmd(argc - 1, argv + 1);
+	}
+	if (argc > 1 && !strcmp(argv[1], "query")) {
+		argv0 = argv[0];
+		return querycmd(argc - 1, argv + 1);
+	}
+
 	/* Parse command line arguments. */
 	struct options options;
 	if (parseCmdLine(argc, argv, &options) < 0 || options.given_h) {
@@ -93,103 +236,531 @@ int main(int argc, char** argv)
 	 * messages in the above functions. */
 	argv0 = argv[0];
 
-	int new = options.avg;
-	double times[new + 1][2];
+	/* Set up a moving average for each output file, and open them. */
+	struct window windows[MAXWINDOWS];
+	int nwindows = options.noutput;
+	int longest = 0;
+	for (int i = 0; i < nwindows; i++) {
+		struct window *w = &windows[i];
+		w->samples = options.navg ? options.avg[i] : 1;
+		w->halflife = options.navg ? options.halflife[i] : 0;
+		w->hist = NULL;
+		w->threshold = options.threshold;
+		w->heartbeat = llround(options.heartbeat * 1e9);
+		w->written = 0;
+		if (options.percentiles && !w->halflife &&
+		    !(w->hist = malloc(sizeof(*w->hist)))) {
+			fprintf(stderr, "%s: Could not allocate a histogram (%s)\n",
+			        argv0, strerror(errno));
+			return -1;
+		}
+		if (w->samples > longest) {
+			longest = w->samples;
+		}
+		if (openoutput(&w->out, options.output[i], options.mode) < 0) {
+			return -1;
+		}
+	}
+	struct output statout;
+	if (options.stat && openoutput(&statout, options.stat, options.mode) < 0) {
+		return -1;
+	}
+	struct record record;
+	if (options.record && openrecord(&record, options.record) < 0) {
+		return -1;
+	}
+	struct output selfout;
+	if (options.selfstats && openoutput(&selfout, options.selfstats,
+	                                    options.mode) < 0) {
+		return -1;
+	}
+	struct output promout;
+	if (options.prom && openoutput(&promout, options.prom, OUT_RENAME) < 0) {
+		return -1;
+	}
+	struct output cgroupout;
+	if (options.cgroupstat && openoutput(&cgroupout, options.cgroupstat,
+	                                     options.mode) < 0) {
+		return -1;
+	}
+	struct cgroup cgroups[MAXCGROUPS];
+	for (int i = 0; i < options.ncgroup; i++) {
+		if (opencgroup(&cgroups[i], options.cgroup[i]) < 0) {
+			return -1;
+		}
+	}
+	struct buf selfbuf = { NULL, 0, 0, 0, 0 };
+	struct selfstats self;
+	selfinit(&self);
+
+	/* Outputs are written by writer threads if asked for, so that a slow
+	 * one cannot hold up the sampling. The windows' outputs are numbered
+	 * first, then those for --stat, --self-stats, --prom and --cgroup-stat.
+	 * A replay has no schedule to keep, so it waits for the writers
+	 * instead. */
+	struct writers writers;
+	if (startwriters(&writers, options.writers, options.replay != NULL) < 0) {
+		return -1;
+	}
+	int statjob = nwindows, selfjob = nwindows + 1, promjob = nwindows + 2;
+	int cgroupjob = nwindows + 3;
+
+	/* Samples are taken from /proc, or from a capture being replayed. */
+	struct procsource proc;
+	if (openproc(&proc, options.procroot, options.highres, options.capture,
+	             options.replay) < 0) {
+		return -1;
+	}
+
+	/* Samples are taken on a fixed schedule starting now, or one after the
+	 * other when replaying. A signal to stop cuts the wait short, so that
+	 * files can be finished off promptly. */
+	struct tick tick;
+	if (tickinit(&tick, options.replay ? 0 : options.interval) < 0) {
+		return -1;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = report;
+	sigaction(SIGUSR1, &sa, NULL);
+	tick.stop = &stopping;
+
+	/* Each moving average needs the current sample and the one taken as
+	 * many intervals before it as the window is long, so all of them can be
+	 * worked out from a ring holding one more sample than the longest. To
+	 * take the interval which has just left a window out of its histogram
+	 * needs one more. */
+	struct ring ring;
+	if (ringinit(&ring, (size_t)longest + (options.percentiles ? 2 : 1)) < 0) {
+		return -1;
+	}
+
+	/* Unless we were told how many CPUs there are, count the ones online,
+	 * and keep counting them in case one is added or removed. When the
+	 * files come from somewhere other than this system's /proc, the CPUs
+	 * listed in stat are counted instead, or those in schedstat when that
+	 * is read. */
+	struct cpuinfo cpus;
+	memset(&cpus, 0, sizeof(cpus));
+	double ncpu = options.ncpu;
+	int schedcpus = !options.ncpu && proc.highres;
+	int statcpus = !options.ncpu && !proc.highres &&
+	               (options.procroot || options.replay);
+	if (!options.ncpu && !statcpus && !schedcpus) {
+		if (readcpus(&cpus) < 0) {
+			return -1;
+		}
+		ncpu = cpus.online;
 
-	/* Read the file once and calculate average utilisation so far. */
-	if (readuptime(&times[0][0], &times[0][1]) < 0) {
+		/* Idle time in /proc/uptime is counted for the whole system, so
+		 * it must be divided by all the CPUs online even if this process
+		 * is limited to fewer. */
+		if (cpus.capacity < cpus.online) {
+			fprintf(stderr, "%s: Note: this process may only use %.2f of "
+			        "the %d CPUs online; utilisation is reported for the "
+			        "whole system\n", argv0, cpus.capacity, cpus.online);
+		}
+	}
+
+	struct cpuwatch_shm *shm = NULL;
+	if (options.shm && !(shm = openshm(options.shm))) {
 		return -1;
 	}
-	double u = 100 - 100 * ((times[0][1] / options.ncpu) / times[0][0]);
+	struct cpuwatch_snapshot snap;
+	memset(&snap, 0, sizeof(snap));
+	snap.nwindows = nwindows;
+	for (int i = 0; i < nwindows; i++) {
+		snap.windows[i].seconds = windows[i].halflife ? windows[i].halflife :
+		                          windows[i].samples * options.interval;
+	}
 
-	/* Pad out the rest of the buffer with copies of the first reading. */
-	for (int i = 1; i < new + 1; i++) {
-		times[i][0] = times[i-1][0];
-		times[i][1] = times[i-1][1];
+	struct history history;
+	if (options.history && openhistory(&history, options.history,
+	                                   options.historysize, options.rollup,
+	                                   options.nrollup,
+	                                   options.interval) < 0) {
+		return -1;
 	}
 
-	/* Continue indefinitely. The program will only terminate if interrupted
-	 * with SIGINT/SIGKILL etc, or faults. */
-	while (1) {
-		/* Write the utilisation to the file. */
-		if (writeutil(u, options.output) < 0) {
+	/* Queries are answered, subscribers sent updates and metrics served
+	 * from a thread of its own, which is handed a view of each sample
+	 * labelled with the length of each window. */
+	struct server server;
+	char labels[MAXWINDOWS][32];
+	struct metrics metrics;
+	int serving = options.socket || options.subscribe || options.http;
+	if (serving) {
+		if (startserver(&server, options.socket, options.subscribe,
+		                options.http,
+		                options.history ? history.hdr : NULL) < 0) {
 			return -1;
 		}
+		for (int i = 0; i < nwindows; i++) {
+			snprintf(labels[i], sizeof(labels[i]), "%gs ",
+			         snap.windows[i].seconds);
+		}
+	}
+	if (options.http || options.prom) {
+		initmetrics(&metrics, &snap, windows);
+	}
+
+	/* Per-CPU counters are kept for the current and previous readings, and
+	 * the difference between them, which is needed for --stat and
+	 * queries. */
+	int wantdelta = options.stat || options.socket;
+	int wantstat = wantdelta || options.record || options.http ||
+	               options.prom || statcpus;
+	struct cpustat stat[3];
+	struct cpustat *cur = &stat[0], *prev = &stat[1], *delta = &stat[2];
+	memset(stat, 0, sizeof(stat));
 
-		/* Wait for some time. */
-		if (usleep(options.interval * 1000000) < 0 && errno != EINTR) {
-			fprintf(stderr, "%s: Error in usleep (%s)\n",
-			        argv[0],
-			        strerror(errno));
+	/* Read the files once and calculate average utilisation so far. */
+	struct sample s;
+	int n = takesample(&proc, wantstat, options.ncpu, &s, prev, &self);
+	if (n <= 0) {
+		if (n == 0) {
+			fprintf(stderr, "%s: '%s' holds no samples\n", argv0,
+			        options.replay);
+		}
+		return -1;
+	}
+	snap.realtime = proc.realtime;
+	snap.monotonic = proc.monotonic;
+	if (statcpus) {
+		ncpu = prev->ncpu;
+	} else if (schedcpus) {
+		ncpu = proc.ncpu;
+	}
+	for (int i = 0; i < options.ncgroup; i++) {
+		readcgroup(&cgroups[i], ncpu);
+	}
+	s.total = s.uptime * ncpu;
+	ringpush(&ring, &s);
+	for (int i = 0; i < nwindows; i++) {
+		initwindow(&windows[i], &s);
+	}
+	if (options.history) {
+		recordhistory(&history, &s, ncpu, snap.realtime);
+	}
+
+	if (options.record && recordstat(&record, prev, snap.realtime) < 0) {
+		return -1;
+	}
+
+	/* Continue until asked to stop, or the end of a replay. The program
+	 * will otherwise only terminate if killed, or if it faults. */
+	self.samples = 1;
+	int64_t began;
+	monotime(&began);
+	while (!stopping) {
+		/* Write the utilisation to the files. */
+		struct buf *b;
+		if (writersfailed(&writers)) {
 			return -1;
 		}
+		for (int i = 0; i < nwindows; i++) {
+			struct window *w = &windows[i];
+			if ((b = outputbegin(&writers, i, &w->out)) &&
+			    windowchanged(w, snap.monotonic)) {
+				renderwindow(w, b);
+				if (outputend(&writers, i, &w->out, b) < 0) {
+					return -1;
+				}
+			}
+			snap.windows[i].util = w->util;
+			snap.windows[i].p50 = w->hist ? w->p50 : w->util;
+			snap.windows[i].p90 = w->hist ? w->p90 : w->util;
+			snap.windows[i].p99 = w->hist ? w->p99 : w->util;
+			snap.windows[i].max = w->hist ? w->max : w->util;
+		}
+		snap.sample++;
+		snap.util = windows[0].util;
+		snap.ncpu = ncpu;
+		if (serving) {
+			struct view *v = backview(&server);
+			for (int i = 0; i < nwindows; i++) {
+				bufputs(&v->util, labels[i]);
+				renderwindow(&windows[i], &v->util);
+				bufput(&v->util, "\n", 1);
+			}
+			if (delta->ncpu) {
+				renderstat(delta, &v->cpus);
+			}
+			if (options.http) {
+				rendermetrics(&metrics, &snap, prev, cgroups,
+				              options.ncgroup, &v->metrics);
+			}
+			v->update->snap = snap;
+			publishview(&server);
+		}
+		if (shm) {
+			publishshm(shm, &snap);
+		}
+		if (options.prom && (b = outputbegin(&writers, promjob, &promout))) {
+			rendermetrics(&metrics, &snap, prev, cgroups, options.ncgroup,
+			              b);
+			if (outputend(&writers, promjob, &promout, b) < 0) {
+				return -1;
+			}
+		}
+		if (options.cgroupstat &&
+		    (b = outputbegin(&writers, cgroupjob, &cgroupout))) {
+			for (int i = 0; i < options.ncgroup; i++) {
+				rendercgroup(&cgroups[i], b);
+			}
+			if (outputend(&writers, cgroupjob, &cgroupout, b) < 0) {
+				return -1;
+			}
+		}
+		selfstage(&self, STAGE_WRITE);
+
+		/* Report on our own running, if asked to. */
+		if (options.selfstats || reporting) {
+			selfbuf.len = 0;
+			selfreport(&self, &selfbuf, tick.overruns,
+			           outputoverflows(&writers));
+			if (selfbuf.err) {
+				fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+				        argv0, strerror(errno));
+				return -1;
+			}
+			if (options.selfstats &&
+			    (b = outputbegin(&writers, selfjob, &selfout))) {
+				bufput(b, selfbuf.data, selfbuf.len);
+				if (outputend(&writers, selfjob, &selfout, b) < 0) {
+					return -1;
+				}
+			}
+			if (reporting) {
+				reporting = 0;
+				fwrite(selfbuf.data, 1, selfbuf.len, stderr);
+			}
+		}
 
-		/* Shift the values down and read another set of times. */
-		for (int i = 0; i < new; i++) {
-			times[i][0] = times[i+1][0];
-			times[i][1] = times[i+1][1];
+		/* Wait for the next deadline. */
+		if (tickwait(&tick) < 0) {
+			return -1;
+		}
+		if (stopping) {
+			break;
 		}
-		if (readuptime(&times[new][0], &times[new][1]) < 0) {
+		selfwake(&self, tick.late);
+
+		/* Read another set of times, replacing the oldest. */
+		double lastuptime = s.uptime;
+		n = takesample(&proc, wantstat, options.ncpu, &s, cur, &self);
+		if (n < 0) {
 			return -1;
 		}
+		if (n == 0) {
+			break;
+		}
+		self.samples++;
+		snap.realtime = proc.realtime;
+		snap.monotonic = proc.monotonic;
+		if (statcpus) {
+			ncpu = cur->ncpu;
+		} else if (schedcpus) {
+			ncpu = proc.ncpu;
+		} else if (!options.ncpu) {
+			if (readcpus(&cpus) < 0) {
+				return -1;
+			}
+			ncpu = cpus.online;
+		}
+		for (int i = 0; i < options.ncgroup; i++) {
+			readcgroup(&cgroups[i], ncpu);
+		}
+		selfstage(&self, STAGE_READ);
 
 		/* Perform the calculation again. */
-		double uptimediff = times[new][0] - times[0][0];
-		double idletimediff = times[new][1] - times[0][1];
-		u = 100 - 100 * ((idletimediff / options.ncpu) / uptimediff);
+		s.total += (s.uptime - lastuptime) * ncpu;
+		ringpush(&ring, &s);
+		for (int i = 0; i < nwindows; i++) {
+			updatewindow(&windows[i], &ring);
+		}
+		if (wantdelta && statdelta(delta, cur, prev) < 0) {
+			return -1;
+		}
+		selfstage(&self, STAGE_COMPUTE);
+
+		/* Record the sample, and write what was worked out from it. */
+		if (options.history) {
+			recordhistory(&history, &s, ncpu, snap.realtime);
+		}
+		if (options.record && recordstat(&record, cur, snap.realtime) < 0) {
+			return -1;
+		}
+		if (options.stat && (b = outputbegin(&writers, statjob, &statout))) {
+			renderstat(delta, b);
+			if (outputend(&writers, statjob, &statout, b) < 0) {
+				return -1;
+			}
+		}
+		if (wantstat) {
+			struct cpustat *t = prev;
+			prev = cur;
+			cur = t;
+		}
 	}
 
+	/* Write out whatever has been held back in memory, or is still
+	 * waiting for a writer. */
+	if (serving) {
+		stopserver(&server);
+	}
+	if (stopwriters(&writers) < 0) {
+		return -1;
+	}
+	if (options.record && flushrecord(&record) < 0) {
+		return -1;
+	}
+	if (options.history) {
+		closehistory(&history);
+	}
+	for (int i = 0; i < options.ncgroup; i++) {
+		closecgroup(&cgroups[i]);
+	}
+
+	if (options.replay) {
+		int64_t ended;
+		monotime(&ended);
+		double secs = (ended - began) / 1e9;
+		fprintf(stderr, "%s: Replayed %lu samples in %.3f seconds "
+		        "(%.0f samples per second)\n", argv0, self.samples, secs,
+		        secs > 0 ? self.samples / secs : 0);
+	}
 	return 0;
 }
 
 /*
- * Read the file /proc/uptime to get the total system uptime and the idle time.
- * Return the two numbers in the given arguments. Close the file so that we can
- * open it again later.
+ * Handle SIGINT and SIGTERM by asking the main loop to stop.
+ */
+static void stop(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+/*
+ * Handle SIGUSR1 by asking the main loop to report on its own running.
+ */
+static void report(int sig)
+{
+	(void)sig;
+	reporting = 1;
+}
+
+/*
+ * Take the next sample from p, and parse the uptime and idle time into s (of
+ * ncpu CPUs, or of those listed in schedstat if it is 0, when that is read),
+ * and the per-CPU counters into st if wantstat is set, timing each in self.
  *
- * On success, 0 is returned, and uptime and idle-time are set to the
- * corresponding values from the file.
- * On failure, -1 is returned, and errno is set to indicate the error.
+ * Returns 1 if a sample was taken, 0 at the end of a replay, or -1 on failure,
+ * with errno set to indicate the error.
  */
-int readuptime(double *uptime, double *idletime)
+int takesample(struct procsource *p, int wantstat, double ncpu,
+               struct sample *s, struct cpustat *st, struct selfstats *self)
 {
-	FILE *file = fopen("/proc/uptime", "r");
-	if (!file) {
-		fprintf(stderr, "%s: Could not open /proc/uptime (%s)",
-		        argv0, strerror(errno));
-		return -1;
+	int n = readproc(p, wantstat);
+	if (n <= 0) {
+		return n;
 	}
+	selfstage(self, STAGE_READ);
 
-	if (fscanf(file, "%lf %lf", uptime, idletime) != 2) {
-		fprintf(stderr, "%s: Error scanning /proc/uptime",
-		        argv0, strerror(errno));
+	if (p->highres) {
+		if (parseschedstat(p, ncpu, &s->uptime, &s->idle) < 0) {
+			fprintf(stderr, "%s: Error scanning schedstat\n", argv0);
+			return -1;
+		}
+	} else if (parseuptime(p->uptime, &s->uptime, &s->idle) < 0) {
+		fprintf(stderr, "%s: Error scanning uptime\n", argv0);
 		return -1;
 	}
+	if (wantstat && parsestat(st, p->stat, p->statlen) < 0) {
+		fprintf(stderr, "%s: Error scanning stat\n", argv0);
+		return -1;
+	}
+	selfstage(self, STAGE_PARSE);
+	return 1;
+}
 
-	fclose(file);
-	return 0;
+/*
+ * Convert a non-negative decimal number such as "12" or "0.5" to a double.
+ *
+ * On success, 0 is returned, and d is set to the number.
+ * On failure, -1 is returned.
+ */
+int parsedecimal(const char *c, double *d)
+{
+	int v = 0;
+	*d = 0;
+
+	for (; *c >= '0' && *c <= '9'; c++) {
+		*d = (*d * 10) + (*c - '0');
+	}
+	if (*c == '.') {
+		for (c++; *c >= '0' && *c <= '9'; c++) {
+			*d = (*d * 10) + (*c - '0');
+			v++;
+		}
+	}
+	for (; v; v--) {
+		*d /= 10;
+	}
+
+	return *c ? -1 : 0;
 }
 
 /*
- * Write the CPU utilisation to the given file. Truncate the file to length 0
- * before writing ("w" flag). Immediately close the file so that we can be
- * lazy and do this again later.
+ * Convert a string of decimal digits to an unsigned integer.
  *
- * On success, 0 is returned.
- * On failure, -1 is returned, and errno is set to indicate the error.
+ * On success, 0 is returned, and n is set to the number.
+ * On failure, -1 is returned.
  */
-int writeutil(double util, char *path)
+int parsecount(const char *c, unsigned long long *n)
 {
-	FILE *file = fopen(path, "w");
-	if (!file) {
-		fprintf(stderr, "%s: Could not open '%s' (%s)",
-		        argv0, path, strerror(errno));
+	*n = 0;
+	if (!*c) {
 		return -1;
 	}
+	for (; *c; c++) {
+		if (*c < '0' || *c > '9' || *n > (~0ULL - 9) / 10) {
+			return -1;
+		}
+		*n = (*n * 10) + (*c - '0');
+	}
+	return 0;
+}
+
+/*
+ * Parse a tier of rollups given as "SECONDS:COUNT", e.g. "60:1440" for a day
+ * of one-minute rollups.
+ *
+ * On success, 0 is returned, and tier is filled in.
+ * On failure, -1 is returned.
+ */
+int parserollup(const char *c, struct tierspec *tier)
+{
+	char seconds[32];
+	unsigned long long count;
+	const char *colon = strchr(c, ':');
 
-	fprintf(file, "%.1f%%", util);
+	if (!colon || (size_t)(colon - c) >= sizeof(seconds)) {
+		return -1;
+	}
+	memcpy(seconds, c, colon - c);
+	seconds[colon - c] = '\0';
 
-	fclose(file);
+	if (parsedecimal(seconds, &tier->seconds) < 0 || tier->seconds <= 0 ||
+	    parsecount(colon + 1, &count) < 0 || !count) {
+		return -1;
+	}
+	tier->capacity = count;
 	return 0;
 }
 
@@ -209,10 +780,34 @@ int writeutil(double util, char *path)
  */
 int parseCmdLine(int argc, char **argv, struct options *options)
 {
-	options->output = NULL;
+	options->noutput = 0;
+	options->stat = NULL;
+	options->shm = NULL;
+	options->history = NULL;
+	options->historysize = 86400;
+	options->rollup[0] = (struct tierspec){ 60, 1440 };
+	options->rollup[1] = (struct tierspec){ 3600, 8760 };
+	options->nrollup = 2;
+	options->record = NULL;
+	options->procroot = NULL;
+	options->capture = NULL;
+	options->replay = NULL;
+	options->selfstats = NULL;
+	options->socket = NULL;
+	options->subscribe = NULL;
+	options->prom = NULL;
+	options->ncgroup = 0;
+	options->cgroupstat = NULL;
+	options->mode = OUT_TRUNCATE;
+	options->percentiles = 0;
+	options->highres = 0;
+	options->threshold = -1;
+	options->writers = 0;
+	options->http = 0;
+	options->heartbeat = -1;
 	options->interval = 1.0;
 	options->ncpu = 0;
-	options->avg = 1;
+	options->navg = 0;
 	options->given_h = 0;
 
 	/* We record extra data so we can produce better error messages. */
@@ -220,11 +815,35 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 	int given_i = 0;
 	int given_c = 0;
 	int given_n = 0;
+	int given_s = 0;
+	int given_m = 0;
+	int given_w = 0;
+	int given_H = 0;
+	int given_r = 0;
+	int given_rollup = 0;
+	int given_procroot = 0;
+	int given_capture = 0;
+	int given_replay = 0;
+	int given_selfstats = 0;
+	int given_socket = 0;
+	int given_subscribe = 0;
+	int given_prom = 0;
+	int given_cgroup = 0;
+	int given_cgroupstat = 0;
+	char *badrollup = NULL;
+	char *badhistorysize = NULL;
+	char *badthreshold = NULL;
+	char *badheartbeat = NULL;
+	char *badwriters = NULL;
+	char *badhttp = NULL;
 
 	int badintervals = 0;
 	int badncpus = 0;
 	int badavgs = 0;
+	char *badmode = NULL;
+	int badhalflives = 0;
 	char *given_badinterval[argc];
+	char *given_badhalflife[argc];
 	char *given_badncpu[argc];
 	char *given_badavg[argc];
 
@@ -237,18 +856,43 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 	/* Temporary variables for calculations and such */
 	int v;
 	double d;
-	char *c;
+	unsigned long long count;
 
 	/* The options we can detect with getopt */
-	struct option getopts[6] = {
+	struct option getopts[31] = {
 		{"output", required_argument, 0, 'o'},
 		{"interval", required_argument, 0, 'i'},
+		{"cpus", required_argument, 0, 'c'},
 		{"ncpu", required_argument, 0, 'c'},
 		{"samples", required_argument, 0, 'n'},
+		{"half-life", required_argument, 0, 'e'},
+		{"time-constant", required_argument, 0, OPT_TIMECONSTANT},
+		{"stat", required_argument, 0, 's'},
+		{"shm", required_argument, 0, 'm'},
+		{"write", required_argument, 0, 'w'},
+		{"history", required_argument, 0, 'H'},
+		{"history-size", required_argument, 0, OPT_HISTORYSIZE},
+		{"rollup", required_argument, 0, OPT_ROLLUP},
+		{"record", required_argument, 0, 'r'},
+		{"proc-root", required_argument, 0, OPT_PROCROOT},
+		{"capture", required_argument, 0, OPT_CAPTURE},
+		{"replay", required_argument, 0, OPT_REPLAY},
+		{"self-stats", required_argument, 0, OPT_SELFSTATS},
+		{"high-res", no_argument, 0, OPT_HIGHRES},
+		{"threshold", required_argument, 0, OPT_THRESHOLD},
+		{"heartbeat", required_argument, 0, OPT_HEARTBEAT},
+		{"writers", required_argument, 0, OPT_WRITERS},
+		{"socket", required_argument, 0, OPT_SOCKET},
+		{"subscribe", required_argument, 0, OPT_SUBSCRIBE},
+		{"http", required_argument, 0, OPT_HTTP},
+		{"prom", required_argument, 0, OPT_PROM},
+		{"cgroup", required_argument, 0, OPT_CGROUP},
+		{"cgroup-stat", required_argument, 0, OPT_CGROUPSTAT},
+		{"percentiles", no_argument, 0, 'p'},
 		{"help", no_argument, 0, 'h'},
 		{0, 0, 0, 0}
 	};
-	const char *optstring = ":ho:c:n:i:";
+	const char *optstring = ":hpo:c:n:e:i:s:m:w:H:r:";
 
 	int opt;
 	opterr = 0; /* Suppress errors from getopt */
@@ -258,43 +902,35 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 	case 'h': /* -h or --help */
 		options->given_h++;
 		return 0;
+	case 'p': /* -p or --percentiles */
+		options->percentiles = 1;
+		break;
 	case 'o': /* -o or --output */
-		given_o++;
-		options->output = optarg;
+		if (given_o++ < MAXWINDOWS) {
+			options->output[options->noutput++] = optarg;
+		}
 		break;
 	case 'i': /* -i or --interval */
 		given_i++;
-
-		v = 0;
-		d = 0;
-		c = optarg;
-
-		/* Convert the string to a double. */
-		for (; *c; c++) {
-			if (*c < '0' || *c > '9') {
-				if (*c != '.') {
-					given_badinterval[badintervals++] = optarg;
-				}
-				break;
-			}
-			d = (d * 10) + (*c - '0');
+		if (parsedecimal(optarg, &d) < 0) {
+			given_badinterval[badintervals++] = optarg;
+			break;
 		}
-		if (*c == '.') {
-			for (c++; *c; c++) {
-				if (*c < '0' || *c > '9') {
-					given_badinterval[badintervals++] = optarg;
-					break;
-				}
-				d = (d * 10) + (*c - '0');
-				v++;
-			}
+		options->interval = d;
+		break;
+	case 'e': /* -e or --half-life */
+	case OPT_TIMECONSTANT: /* --time-constant */
+		given_n++;
+		if (parsedecimal(optarg, &d) < 0 || d <= 0) {
+			given_badhalflife[badhalflives++] = optarg;
+			break;
 		}
-		for (; v; v--) {
-			d /= 10;
+		if (given_n <= MAXWINDOWS) {
+			/* A time constant tau has a half-life of tau * ln 2. */
+			options->avg[options->navg] = 1;
+			options->halflife[options->navg++] =
+				opt == 'e' ? d : d * M_LN2;
 		}
-
-		options->interval = d;
-
 		break;
 	case 'c': /* -c or --cpus */
 		given_c++;
@@ -323,8 +959,123 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 			}
 			v = (v * 10) + (*c - '0');
 		}
-		options->avg = v;
+		if (given_n <= MAXWINDOWS) {
+			options->halflife[options->navg] = 0;
+			options->avg[options->navg++] = v;
+		}
 
+		break;
+	case 's': /* -s or --stat */
+		given_s++;
+		options->stat = optarg;
+		break;
+	case 'm': /* -m or --shm */
+		given_m++;
+		options->shm = optarg;
+		break;
+	case 'w': /* -w or --write */
+		given_w++;
+		if ((v = outmodebyname(optarg)) < 0) {
+			badmode = optarg;
+			break;
+		}
+		options->mode = v;
+		break;
+	case 'H': /* -H or --history */
+		given_H++;
+		options->history = optarg;
+		break;
+	case OPT_HISTORYSIZE: /* --history-size */
+		if (parsecount(optarg, &options->historysize) < 0 ||
+		    !options->historysize) {
+			badhistorysize = optarg;
+		}
+		break;
+	case OPT_ROLLUP: /* --rollup */
+		/* Any tiers given replace the default ones. */
+		if (given_rollup++ == 0) {
+			options->nrollup = 0;
+		}
+		if (!strcmp(optarg, "none")) {
+			break;
+		}
+		if (options->nrollup == CPUWATCH_HISTORY_MAXTIERS) {
+			badrollup = optarg;
+			break;
+		}
+		if (parserollup(optarg, &options->rollup[options->nrollup]) < 0) {
+			badrollup = optarg;
+			break;
+		}
+		options->nrollup++;
+		break;
+	case OPT_PROCROOT: /* --proc-root */
+		given_procroot++;
+		options->procroot = optarg;
+		break;
+	case OPT_CAPTURE: /* --capture */
+		given_capture++;
+		options->capture = optarg;
+		break;
+	case OPT_REPLAY: /* --replay */
+		given_replay++;
+		options->replay = optarg;
+		break;
+	case OPT_THRESHOLD: /* --threshold */
+		if (parsedecimal(optarg, &options->threshold) < 0) {
+			badthreshold = optarg;
+		}
+		break;
+	case OPT_HEARTBEAT: /* --heartbeat */
+		if (parsedecimal(optarg, &options->heartbeat) < 0) {
+			badheartbeat = optarg;
+		}
+		break;
+	case OPT_SOCKET: /* --socket */
+		given_socket++;
+		options->socket = optarg;
+		break;
+	case OPT_SUBSCRIBE: /* --subscribe */
+		given_subscribe++;
+		options->subscribe = optarg;
+		break;
+	case OPT_CGROUP: /* --cgroup */
+		if (given_cgroup++ < MAXCGROUPS) {
+			options->cgroup[options->ncgroup++] = optarg;
+		}
+		break;
+	case OPT_CGROUPSTAT: /* --cgroup-stat */
+		given_cgroupstat++;
+		options->cgroupstat = optarg;
+		break;
+	case OPT_PROM: /* --prom */
+		given_prom++;
+		options->prom = optarg;
+		break;
+	case OPT_HTTP: /* --http */
+		if (parsecount(optarg, &count) < 0 || !count || count > 65535) {
+			badhttp = optarg;
+			break;
+		}
+		options->http = count;
+		break;
+	case OPT_WRITERS: /* --writers */
+		if (parsecount(optarg, &count) < 0 || count > MAXWINDOWS + 4) {
+			badwriters = optarg;
+			break;
+		}
+		options->writers = count;
+		break;
+	case OPT_HIGHRES: /* --high-res */
+		options->highres = 1;
+		break;
+	case OPT_SELFSTATS: /* --self-stats */
+		given_selfstats++;
+		options->selfstats = optarg;
+		break;
+	case 'r': /* -r or --record */
+		given_r++;
+		options->record = optarg;
 		break;
 	case '?': /* Unrecognised option */
 		nunrecognized++;
@@ -345,9 +1096,32 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 
 	/* Output error messages to stderr for each error we detected. */
 
-	if (nunrecognized || nmissing || badintervals || badncpus || given_o > 1 ||
-	    given_i > 1 || given_c > 1 || given_n > 1 || given_o == 0 ||
-	    given_c == 0)
+	int mismatched = given_n && given_n != given_o;
+	int replayclash = given_replay &&
+	                  (given_procroot || given_capture || given_cgroup);
+	int cgroupnowhere = given_cgroup && !given_cgroupstat && !options->http &&
+	                    !given_prom;
+	int cgroupunused = given_cgroupstat && !given_cgroup;
+
+	/* A threshold on its own has a heartbeat of a minute, and a heartbeat
+	 * on its own skips writes which would not change the file. */
+	if (options->threshold >= 0 && options->heartbeat < 0) {
+		options->heartbeat = 60;
+	} else if (options->heartbeat >= 0 && options->threshold < 0) {
+		options->threshold = 0;
+	}
+
+	if (nunrecognized || nmissing || badintervals || badncpus ||
+	    badhalflives ||
+	    given_o > MAXWINDOWS || given_n > MAXWINDOWS || mismatched ||
+	    given_i > 1 || given_c > 1 || given_s > 1 ||
+	    given_m > 1 || given_w > 1 || badmode || given_H > 1 ||
+	    badhistorysize || badrollup || badthreshold || badheartbeat ||
+	    badwriters || badhttp ||
+	    given_r > 1 || given_procroot > 1 || given_capture > 1 || given_replay > 1 || replayclash ||
+	    given_selfstats > 1 || given_socket > 1 || given_subscribe > 1 ||
+	    given_prom > 1 || given_cgroup > MAXCGROUPS || given_cgroupstat > 1 ||
+	    cgroupnowhere || cgroupunused || given_o == 0)
 	{
 		fprintf(stderr, "%s: Error(s) processing command line arguments.\n\n",
 		        argv[0]);
@@ -388,9 +1162,9 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 		errors++;
 	}
 
-	if (given_o > 1) {
-		fprintf(stderr, "--output/-o was given %d times (1 maximum).\n",
-		        given_o);
+	if (given_o > MAXWINDOWS) {
+		fprintf(stderr, "--output/-o was given %d times (%d maximum).\n",
+		        given_o, MAXWINDOWS);
 		errors++;
 	}
 	if (given_o == 0) {
@@ -421,10 +1195,6 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 		        given_c);
 		errors++;
 	}
-	if (given_c == 0) {
-		fprintf(stderr, "--cpus/-c was not given.\n");
-		errors++;
-	}
 
 	if (badncpus) {
 		fprintf(stderr, "--cpus/-c was given improperly %d time%s: ",
@@ -437,9 +1207,30 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 		errors++;
 	}
 
-	if (given_n > 1) {
-		fprintf(stderr, "--samples/-n was given %d times (1 maximum).\n",
-		        given_n);
+	if (given_n > MAXWINDOWS) {
+		fprintf(stderr, "--samples/-n and --half-life/-e were given %d "
+		        "times (%d maximum).\n", given_n, MAXWINDOWS);
+		errors++;
+	}
+
+	if (badhalflives) {
+		fprintf(stderr, "--half-life/-e was given improperly %d time%s: ",
+		        badhalflives,
+		        badhalflives > 1 ? "s" : "");
+		for (int i = 0; i < badhalflives; i++) {
+			fprintf(stderr, "'%s'%s", given_badhalflife[i],
+			        i + 1 == badhalflives ? "" : ", ");
+		}
+		fprintf(stderr, ". It must be a positive number of seconds.\n");
+		errors++;
+	}
+
+	if (mismatched) {
+		fprintf(stderr, "Averages (--samples/-n or --half-life/-e) were "
+		        "given %d time%s and --output/-o %d time%s.\nGive one "
+		        "average for each --output/-o.\n",
+		        given_n, given_n > 1 ? "s" : "",
+		        given_o, given_o > 1 ? "s" : "");
 		errors++;
 	}
 
@@ -454,6 +1245,152 @@ int parseCmdLine(int argc, char **argv, struct options *options)
 		errors++;
 	}
 
+	if (given_s > 1) {
+		fprintf(stderr, "--stat/-s was given %d times (1 maximum).\n",
+		        given_s);
+		errors++;
+	}
+
+	if (given_m > 1) {
+		fprintf(stderr, "--shm/-m was given %d times (1 maximum).\n",
+		        given_m);
+		errors++;
+	}
+
+	if (given_w > 1) {
+		fprintf(stderr, "--write/-w was given %d times (1 maximum).\n",
+		        given_w);
+		errors++;
+	}
+
+	if (badmode) {
+		fprintf(stderr, "--write/-w was given improperly: '%s'. It must be "
+		        "one of truncate, rename or pwrite.\n", badmode);
+		errors++;
+	}
+
+	if (given_H > 1) {
+		fprintf(stderr, "--history/-H was given %d times (1 maximum).\n",
+		        given_H);
+		errors++;
+	}
+
+	if (badhistorysize) {
+		fprintf(stderr, "--history-size was given improperly: '%s'. It "
+		        "must be a positive whole number.\n", badhistorysize);
+		errors++;
+	}
+
+	if (badrollup) {
+		fprintf(stderr, "--rollup was given improperly: '%s'. It must be "
+		        "SECONDS:COUNT, e.g. 60:1440, given at most %d times, or "
+		        "'none'.\n", badrollup, CPUWATCH_HISTORY_MAXTIERS);
+		errors++;
+	}
+
+	if (badthreshold) {
+		fprintf(stderr, "--threshold was given improperly: '%s'. It must "
+		        "be a non-negative number of percentage points.\n",
+		        badthreshold);
+		errors++;
+	}
+
+	if (badheartbeat) {
+		fprintf(stderr, "--heartbeat was given improperly: '%s'. It must "
+		        "be a non-negative number of seconds.\n", badheartbeat);
+		errors++;
+	}
+
+	if (badwriters) {
+		fprintf(stderr, "--writers was given improperly: '%s'. It must be "
+		        "a whole number from 0 to %d.\n", badwriters,
+		        MAXWINDOWS + 4);
+		errors++;
+	}
+
+	if (badhttp) {
+		fprintf(stderr, "--http was given improperly: '%s'. It must be "
+		        "a port number from 1 to 65535.\n", badhttp);
+		errors++;
+	}
+
+	if (given_r > 1) {
+		fprintf(stderr, "--record/-r was given %d times (1 maximum).\n",
+		        given_r);
+		errors++;
+	}
+
+	if (given_procroot > 1) {
+		fprintf(stderr, "--proc-root was given %d times (1 maximum).\n",
+		        given_procroot);
+		errors++;
+	}
+
+	if (given_capture > 1) {
+		fprintf(stderr, "--capture was given %d times (1 maximum).\n",
+		        given_capture);
+		errors++;
+	}
+
+	if (given_replay > 1) {
+		fprintf(stderr, "--replay was given %d times (1 maximum).\n",
+		        given_replay);
+		errors++;
+	}
+
+	if (given_selfstats > 1) {
+		fprintf(stderr, "--self-stats was given %d times (1 maximum).\n",
+		        given_selfstats);
+		errors++;
+	}
+
+	if (given_socket > 1) {
+		fprintf(stderr, "--socket was given %d times (1 maximum).\n",
+		        given_socket);
+		errors++;
+	}
+
+	if (given_cgroup > MAXCGROUPS) {
+		fprintf(stderr, "--cgroup was given %d times (%d maximum).\n",
+		        given_cgroup, MAXCGROUPS);
+		errors++;
+	}
+
+	if (given_cgroupstat > 1) {
+		fprintf(stderr, "--cgroup-stat was given %d times (1 maximum).\n",
+		        given_cgroupstat);
+		errors++;
+	}
+
+	if (cgroupnowhere) {
+		fprintf(stderr, "--cgroup needs --cgroup-stat, --http or --prom to "
+		        "report to.\n");
+		errors++;
+	}
+
+	if (cgroupunused) {
+		fprintf(stderr, "--cgroup-stat needs --cgroup.\n");
+		errors++;
+	}
+
+	if (given_prom > 1) {
+		fprintf(stderr, "--prom was given %d times (1 maximum).\n",
+		        given_prom);
+		errors++;
+	}
+
+	if (given_subscribe > 1) {
+		fprintf(stderr, "--subscribe was given %d times (1 maximum).\n",
+		        given_subscribe);
+		errors++;
+	}
+
+	if (replayclash) {
+		fprintf(stderr, "--replay cannot be given with --proc-root, "
+		        "--capture or --cgroup.\n");
+		errors++;
+	}
+
 	/* Return with EINVAL if there were any errors at all. */
 	if (errors) {
 		errno = EINVAL;
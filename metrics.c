@@ -0,0 +1,265 @@
+/*
+ * Rendering of samples as metrics in the Prometheus text exposition format
+ * (version 0.0.4) rather than OpenMetrics, as that is what node_exporter's
+ * textfile collector parses.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+#include "cpuwatch-client.h"
+
+static void putfraction(struct buf *b, uint64_t num, uint64_t den, int digits);
+static void putratio(struct buf *b, double percent);
+static void putcgroups(const struct cgroup *cgroups, int ncgroups,
+                       struct buf *b);
+static void putfamily(struct buf *b, const char *name, const char *type,
+                      const char *help);
+static void putseries(struct buf *b, const char *name, const char *labels,
+                      const char *mode);
+
+/*
+ * Prepare to render metrics for the windows in snap, with the percentiles of
+ * those of windows which keep them. The label for each window is rendered
+ * here, once, so that rendering a sample needs no printf. A window's kind is
+ * part of its label, as an exponentially-weighted average can have the same
+ * length as a moving one.
+ */
+void initmetrics(struct metrics *m, const struct cpuwatch_snapshot *snap,
+                 const struct window *windows)
+{
+	memset(m, 0, sizeof(*m));
+	m->hz = sysconf(_SC_CLK_TCK);
+	if (m->hz <= 0) {
+		m->hz = 100;
+	}
+	for (uint32_t i = 0; i < snap->nwindows; i++) {
+		const char *kind = windows[i].halflife ? "ewma" : "boxcar";
+		snprintf(m->windows[i], sizeof(m->windows[i]),
+		         "{window=\"%gs\",kind=\"%s\"} ",
+		         snap->windows[i].seconds, kind);
+		if (windows[i].hist) {
+			snprintf(m->pcts[i], sizeof(m->pcts[i]),
+			         "{window=\"%gs\",kind=\"%s\",percentile=\"",
+			         snap->windows[i].seconds, kind);
+			m->percentiles = 1;
+		}
+	}
+}
+
+/*
+ * Append the sample in snap, the counters in st for each CPU if it lists any,
+ * and those of each of the ncgroups cgroups, to b as metrics: a HELP and TYPE
+ * line for each family, and a line for each series. Utilisation is given as a
+ * ratio rather than a percentage, and the counters in seconds, as Prometheus
+ * expects.
+ */
+void rendermetrics(const struct metrics *m,
+                   const struct cpuwatch_snapshot *snap,
+                   const struct cpustat *st, const struct cgroup *cgroups,
+                   int ncgroups, struct buf *b)
+{
+	static const char *const pcts[] = { "50", "90", "99", "100" };
+
+	bufputs(b, "# HELP cpuwatch_utilisation_ratio Average utilisation of "
+	        "the CPUs over each window.\n"
+	        "# TYPE cpuwatch_utilisation_ratio gauge\n");
+	for (uint32_t i = 0; i < snap->nwindows; i++) {
+		bufputs(b, "cpuwatch_utilisation_ratio");
+		bufputs(b, m->windows[i]);
+		putratio(b, snap->windows[i].util);
+	}
+
+	if (m->percentiles) {
+		bufputs(b, "# HELP cpuwatch_interval_utilisation_ratio Percentiles "
+		        "of the utilisation over each interval in each window.\n"
+		        "# TYPE cpuwatch_interval_utilisation_ratio gauge\n");
+		for (uint32_t i = 0; i < snap->nwindows; i++) {
+			const struct cpuwatch_window *w = &snap->windows[i];
+			const double values[] = { w->p50, w->p90, w->p99, w->max };
+			if (!m->pcts[i][0]) {
+				continue;
+			}
+			for (int q = 0; q < 4; q++) {
+				bufputs(b, "cpuwatch_interval_utilisation_ratio");
+				bufputs(b, m->pcts[i]);
+				bufputs(b, pcts[q]);
+				bufputs(b, "\"} ");
+				putratio(b, values[q]);
+			}
+		}
+	}
+
+	bufputs(b, "# HELP cpuwatch_cpus CPUs' worth of time the utilisation "
+	        "is measured against.\n"
+	        "# TYPE cpuwatch_cpus gauge\n"
+	        "cpuwatch_cpus ");
+	putfraction(b, llround(snap->ncpu * 100), 100, 2);
+	bufputs(b, "\n# HELP cpuwatch_samples_total Samples taken.\n"
+	        "# TYPE cpuwatch_samples_total counter\n"
+	        "cpuwatch_samples_total ");
+	bufputu(b, snap->sample);
+	bufputs(b, "\n");
+	if (ncgroups) {
+		putcgroups(cgroups, ncgroups, b);
+	}
+
+	if (!st->ncpu) {
+		return;
+	}
+	int digits = m->hz <= 100 ? 2 : 3;
+	bufputs(b, "# HELP cpuwatch_cpu_seconds_total Time each CPU has spent "
+	        "in each mode, from /proc/stat.\n"
+	        "# TYPE cpuwatch_cpu_seconds_total counter\n");
+	for (int i = 0; i < st->ncpu; i++) {
+		for (int mode = 0; mode < NMODES; mode++) {
+			bufputs(b, "cpuwatch_cpu_seconds_total{cpu=\"");
+			bufputu(b, st->id[i]);
+			bufputs(b, "\",mode=\"");
+			bufputs(b, modenames[mode]);
+			bufputs(b, "\"} ");
+			putfraction(b, st->mode[mode][i], m->hz, digits);
+			bufput(b, "\n", 1);
+		}
+	}
+}
+
+/*
+ * Append num / den to b, to the given number of decimal places (at most 4),
+ * rounded down.
+ */
+static void putfraction(struct buf *b, uint64_t num, uint64_t den, int digits)
+{
+	char frac[5] = { '.' };
+	uint64_t rest = num % den;
+
+	bufputu(b, num / den);
+	for (int d = 1; d <= digits; d++) {
+		rest *= 10;
+		frac[d] = '0' + rest / den;
+		rest %= den;
+	}
+	bufput(b, frac, digits + 1);
+}
+
+/*
+ * Append a percentage to b as a ratio to 4 decimal places, ending the line.
+ */
+static void putratio(struct buf *b, double percent)
+{
+	if (!isfinite(percent)) {
+		bufputs(b, isnan(percent) ? "NaN\n" :
+		        percent < 0 ? "-Inf\n" : "+Inf\n");
+		return;
+	}
+	putfraction(b, percent > 0 ? llround(percent * 100) : 0, 10000, 4);
+	bufput(b, "\n", 1);
+}
+
+/*
+ * Append the metrics for each cgroup which is present to b: its counters,
+ * its limit, and its utilisation of that over the last interval once there
+ * is a figure for it.
+ */
+static void putcgroups(const struct cgroup *cgroups, int ncgroups,
+                       struct buf *b)
+{
+	const struct cgroup *cg, *end = cgroups + ncgroups;
+
+	putfamily(b, "cpuwatch_cgroup_utilisation_ratio", "gauge",
+	          "Usage by each cgroup over the last interval, relative to "
+	          "its cpu.max limit.");
+	for (cg = cgroups; cg < end; cg++) {
+		if (cg->ready) {
+			putseries(b, "cpuwatch_cgroup_utilisation_ratio", cg->label,
+			          NULL);
+			putratio(b, cg->util);
+		}
+	}
+	putfamily(b, "cpuwatch_cgroup_limit_cpus", "gauge",
+	          "CPUs' worth of time each cgroup is allowed by cpu.max, or "
+	          "every CPU if it has no limit.");
+	for (cg = cgroups; cg < end; cg++) {
+		if (cg->primed) {
+			putseries(b, "cpuwatch_cgroup_limit_cpus", cg->label, NULL);
+			putfraction(b, llround(cg->limit * 100), 100, 2);
+			bufput(b, "\n", 1);
+		}
+	}
+	putfamily(b, "cpuwatch_cgroup_cpu_seconds_total", "counter",
+	          "Time the tasks in each cgroup have spent running in each "
+	          "mode, from cpu.stat.");
+	for (cg = cgroups; cg < end; cg++) {
+		if (cg->primed) {
+			putseries(b, "cpuwatch_cgroup_cpu_seconds_total", cg->label,
+			          "user");
+			putfraction(b, cg->cur.user, 1000000, 4);
+			bufput(b, "\n", 1);
+			putseries(b, "cpuwatch_cgroup_cpu_seconds_total", cg->label,
+			          "system");
+			putfraction(b, cg->cur.system, 1000000, 4);
+			bufput(b, "\n", 1);
+		}
+	}
+	putfamily(b, "cpuwatch_cgroup_throttled_periods_total", "counter",
+	          "Periods in which each cgroup was throttled.");
+	for (cg = cgroups; cg < end; cg++) {
+		if (cg->primed) {
+			putseries(b, "cpuwatch_cgroup_throttled_periods_total",
+			          cg->label, NULL);
+			bufputu(b, cg->cur.nrthrottled);
+			bufput(b, "\n", 1);
+		}
+	}
+	putfamily(b, "cpuwatch_cgroup_throttled_seconds_total", "counter",
+	          "Time each cgroup has spent throttled.");
+	for (cg = cgroups; cg < end; cg++) {
+		if (cg->primed) {
+			putseries(b, "cpuwatch_cgroup_throttled_seconds_total",
+			          cg->label, NULL);
+			putfraction(b, cg->cur.throttled, 1000000, 4);
+			bufput(b, "\n", 1);
+		}
+	}
+}
+
+/*
+ * Append the HELP and TYPE lines for a family of metrics to b.
+ */
+static void putfamily(struct buf *b, const char *name, const char *type,
+                      const char *help)
+{
+	bufputs(b, "# HELP ");
+	bufputs(b, name);
+	bufput(b, " ", 1);
+	bufputs(b, help);
+	bufputs(b, "\n# TYPE ");
+	bufputs(b, name);
+	bufput(b, " ", 1);
+	bufputs(b, type);
+	bufput(b, "\n", 1);
+}
+
+/*
+ * Append the name and labels of a series to b, with a mode label if mode is
+ * not NULL, up to its value.
+ */
+static void putseries(struct buf *b, const char *name, const char *labels,
+                      const char *mode)
+{
+	bufputs(b, name);
+	bufput(b, "{", 1);
+	bufputs(b, labels);
+	if (mode) {
+		bufputs(b, ",mode=\"");
+		bufputs(b, mode);
+		bufput(b, "\"", 1);
+	}
+	bufputs(b, "} ");
+}
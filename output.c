@@ -0,0 +1,337 @@
+/*
+ * Writing of results to files.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+
+const char *const outmodenames[NOUTMODES] = {
+	"truncate", "rename", "pwrite"
+};
+
+static int writeall(int fd, const char *buf, size_t len, off_t off);
+static int writepadded(int fd, const char *buf, size_t len, size_t width);
+
+/*
+ * Prepare to write to path, using the given strategy each time:
+ *
+ * OUT_TRUNCATE opens the file, truncating it, writes it and closes it again.
+ *  This is the simplest, but a reader can see the file empty.
+ * OUT_RENAME writes a temporary file next to it (path.tmp) and renames it over
+ *  the top, so a reader always sees a complete file, though a new one each
+ *  time.
+ * OUT_PWRITE keeps the file open and overwrites it from the start with a
+ *  single pwrite (or pwritev). The contents are padded with spaces to the
+ *  longest length written so far, so the file never needs to be truncated.
+ *  This makes one system call per write.
+ *
+ * Everything needed later is allocated here, so writes do no allocation.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int openoutput(struct output *out, char *path, enum outmode mode)
+{
+	out->path = path;
+	out->mode = mode;
+	out->fd = -1;
+	out->tmp = NULL;
+	out->width = 0;
+
+	if (mode == OUT_RENAME) {
+		size_t len = strlen(path);
+		out->tmp = malloc(len + sizeof(".tmp"));
+		if (!out->tmp) {
+			fprintf(stderr, "%s: Could not allocate a path (%s)\n",
+			        argv0, strerror(errno));
+			return -1;
+		}
+		memcpy(out->tmp, path, len);
+		memcpy(out->tmp + len, ".tmp", sizeof(".tmp"));
+	}
+
+	if (mode == OUT_PWRITE) {
+		out->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+		if (out->fd < 0 || ftruncate(out->fd, 0) < 0) {
+			fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+			        argv0, path, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Replace the contents of the output with len bytes from buf, using the
+ * strategy chosen in openoutput.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int writeoutput(struct output *out, const char *buf, size_t len)
+{
+	const char *path = out->path;
+	int fd;
+
+	switch (out->mode) {
+	case OUT_PWRITE:
+		if (len >= out->width) {
+			out->width = len;
+			if (writeall(out->fd, buf, len, 0) < 0) {
+				goto fail;
+			}
+			return 0;
+		}
+		if (writepadded(out->fd, buf, len, out->width) < 0) {
+			goto fail;
+		}
+		return 0;
+
+	case OUT_RENAME:
+		path = out->tmp;
+		/* Fall through */
+	case OUT_TRUNCATE:
+	default:
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd < 0) {
+			fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+			        argv0, path, strerror(errno));
+			return -1;
+		}
+		if (writeall(fd, buf, len, -1) < 0) {
+			close(fd);
+			goto fail;
+		}
+		if (close(fd) < 0) {
+			goto fail;
+		}
+		if (out->mode == OUT_RENAME && rename(out->tmp, out->path) < 0) {
+			fprintf(stderr, "%s: Could not rename '%s' to '%s' (%s)\n",
+			        argv0, out->tmp, out->path, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+fail:
+	fprintf(stderr, "%s: Could not write '%s' (%s)\n",
+	        argv0, path, strerror(errno));
+	return -1;
+}
+
+/*
+ * Write the CPU utilisation to the output as a percentage to one decimal
+ * place, e.g. "12.3%".
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int writeutil(struct output *out, double util)
+{
+	char buf[32];
+	struct buf b = { buf, 0, sizeof(buf), 0, 1 };
+
+	bufputpercent(&b, util);
+	return writeoutput(out, b.data, b.len);
+}
+
+/*
+ * Look up an output strategy by name.
+ *
+ * Returns the strategy, or -1 if there is none with that name.
+ */
+int outmodebyname(const char *name)
+{
+	for (int i = 0; i < NOUTMODES; i++) {
+		if (!strcmp(name, outmodenames[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Write all of buf to fd, at offset off, or at the current position if off is
+ * negative.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int writeall(int fd, const char *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t n = off < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		if (off >= 0) {
+			off += n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write len bytes from buf at the start of fd, followed by spaces to make
+ * width bytes in all. The spaces come from a constant buffer, and everything
+ * is written with a single pwritev.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int writepadded(int fd, const char *buf, size_t len, size_t width)
+{
+	static const char spaces[256] = { [0 ... 255] = ' ' };
+	struct iovec iov[64];
+	int n = 0;
+
+	iov[n].iov_base = (void *)buf;
+	iov[n++].iov_len = len;
+	for (size_t pad = width - len; pad; n++) {
+		if (n == 64) {
+			/* Too much padding for one call, so write it in parts. */
+			if (writeall(fd, buf, len, 0) < 0) {
+				return -1;
+			}
+			for (size_t off = len; off < width; off += sizeof(spaces)) {
+				size_t k = width - off;
+				k = k < sizeof(spaces) ? k : sizeof(spaces);
+				if (writeall(fd, spaces, k, off) < 0) {
+					return -1;
+				}
+			}
+			return 0;
+		}
+		iov[n].iov_base = (void *)spaces;
+		iov[n].iov_len = pad < sizeof(spaces) ? pad : sizeof(spaces);
+		pad -= iov[n].iov_len;
+	}
+
+	ssize_t w;
+	while ((w = pwritev(fd, iov, n, 0)) < 0 && errno == EINTR);
+	if (w < 0) {
+		return -1;
+	}
+	if ((size_t)w != width) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Make sure there is room for n more bytes in b, growing it if it is allowed
+ * to grow. Once this has failed, b->err is set and later appends are ignored,
+ * so a sequence of appends need only be checked at the end.
+ *
+ * Returns 0 if there is room, or -1 if not.
+ */
+static int bufreserve(struct buf *b, size_t n)
+{
+	if (b->err) {
+		return -1;
+	}
+	if (b->len + n <= b->cap) {
+		return 0;
+	}
+
+	if (b->fixed) {
+		errno = ENOBUFS;
+		b->err = 1;
+		return -1;
+	}
+	size_t cap = b->cap ? b->cap : 256;
+	while (cap < b->len + n) {
+		cap *= 2;
+	}
+	char *data = realloc(b->data, cap);
+	if (!data) {
+		b->err = 1;
+		return -1;
+	}
+	b->data = data;
+	b->cap = cap;
+	return 0;
+}
+
+/*
+ * Append len bytes from s to b.
+ */
+void bufput(struct buf *b, const char *s, size_t len)
+{
+	if (bufreserve(b, len) < 0) {
+		return;
+	}
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+/*
+ * Append the string s to b.
+ */
+void bufputs(struct buf *b, const char *s)
+{
+	bufput(b, s, strlen(s));
+}
+
+/*
+ * Append the decimal digits of an unsigned integer to b.
+ */
+void bufputu(struct buf *b, uint64_t v)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[sizeof(tmp) - ++n] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	bufput(b, tmp + sizeof(tmp) - n, n);
+}
+
+/*
+ * Append v rounded to one decimal place, e.g. "12.3", to b. This avoids
+ * printf, which is comparatively slow for the little it needs to do here.
+ */
+void bufputfixed(struct buf *b, double v)
+{
+	if (!isfinite(v)) {
+		bufputs(b, isnan(v) ? "nan" : v < 0 ? "-inf" : "inf");
+		return;
+	}
+
+	if (v < 0 && llround(v * 10) != 0) {
+		bufput(b, "-", 1);
+		v = -v;
+	}
+	uint64_t tenths = llround(fabs(v) * 10);
+	bufputu(b, tenths / 10);
+	char frac[2] = { '.', '0' + tenths % 10 };
+	bufput(b, frac, 2);
+}
+
+/*
+ * Append v as a percentage to one decimal place, e.g. "12.3%", to b.
+ */
+void bufputpercent(struct buf *b, double v)
+{
+	bufputfixed(b, v);
+	bufput(b, "%", 1);
+}
@@ -0,0 +1,488 @@
+/*
+ * Reading of the files in /proc which samples are taken from, either live or
+ * from a capture of them being replayed.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+
+#define CAPTURE_MAGIC 0x50414357 /* "WCAP" */
+
+/* Set in the flags of a frame taken with --high-res, which holds schedstat in
+ * place of uptime. */
+#define FRAME_SCHEDSTAT 1
+
+/* A capture file is a sequence of frames, one for each sample, each of which
+ * is this header followed by the contents of uptime and then of stat. The
+ * fields are in the byte order of the machine which made the capture. */
+struct frame {
+	uint32_t magic;      /* CAPTURE_MAGIC. */
+	uint32_t uptimelen;  /* Bytes of uptime which follow. */
+	uint32_t statlen;    /* Bytes of stat which follow those. */
+	uint32_t flags;      /* FRAME_ flags. */
+	int64_t realtime;    /* CLOCK_REALTIME when they were read, in ns. */
+	int64_t monotonic;   /* CLOCK_MONOTONIC when they were read, in ns. */
+};
+
+static char *joinpath(const char *dir, const char *name);
+static int readfile(int *fd, const char *path, char **buf, size_t *len,
+                    size_t *cap);
+static int nextframe(struct procsource *p);
+static int writeframe(struct procsource *p);
+
+/*
+ * Prepare to take samples from the files under root (or /proc if it is
+ * NULL). If highres is set, schedstat is read in place of uptime. If capture
+ * is not NULL, a frame holding what was read for each sample is appended to
+ * that file. If replay is not NULL, samples are taken from the frames of that
+ * capture file instead, in order, with the times they were captured at, and
+ * p->highres is set from the first of them.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int openproc(struct procsource *p, const char *root, int highres,
+             const char *capture, const char *replay)
+{
+	memset(p, 0, sizeof(*p));
+	p->uptimefd = -1;
+	p->statfd = -1;
+	p->capture = -1;
+
+	if (replay) {
+		int fd = open(replay, O_RDONLY | O_CLOEXEC);
+		struct stat sb;
+		if (fd < 0 || fstat(fd, &sb) < 0) {
+			fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+			        argv0, replay, strerror(errno));
+			return -1;
+		}
+		p->replaypath = replay;
+		p->replaysize = sb.st_size;
+		p->replay = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ,
+		                              MAP_PRIVATE, fd, 0) : NULL;
+		close(fd);
+		if (p->replay == MAP_FAILED) {
+			fprintf(stderr, "%s: Could not map '%s' (%s)\n",
+			        argv0, replay, strerror(errno));
+			return -1;
+		}
+		madvise((void *)p->replay, p->replaysize, MADV_SEQUENTIAL);
+		p->replaying = 1;
+		if (p->replaysize >= sizeof(struct frame)) {
+			const struct frame *f = (const struct frame *)p->replay;
+			p->highres = !!(f->flags & FRAME_SCHEDSTAT);
+		}
+		return 0;
+	}
+
+	p->highres = highres;
+	p->uptimepath = joinpath(root ? root : "/proc",
+	                         highres ? "schedstat" : "uptime");
+	p->statpath = joinpath(root ? root : "/proc", "stat");
+	if (!p->uptimepath || !p->statpath) {
+		return -1;
+	}
+
+	if (capture) {
+		p->capturepath = capture;
+		p->capture = open(capture, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+		                  0644);
+		if (p->capture < 0) {
+			fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+			        argv0, capture, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Take the next sample: read uptime, or schedstat if p->highres is set, (and
+ * stat too if wantstat is set, or a capture is being made) into p->uptime and
+ * p->stat, and the time it was taken into p->realtime and p->monotonic.
+ * p->uptime is nul-terminated.
+ *
+ * Returns 1 if a sample was taken, 0 if the capture being replayed has come to
+ * an end, or -1 on failure, with errno set to indicate the error.
+ */
+int readproc(struct procsource *p, int wantstat)
+{
+	if (p->replaying) {
+		return nextframe(p);
+	}
+
+	if (readfile(&p->uptimefd, p->uptimepath, &p->uptimebuf,
+	             &p->uptimelen, &p->uptimecap) < 0) {
+		return -1;
+	}
+	p->uptime = p->uptimebuf;
+
+	if (wantstat || p->capture >= 0) {
+		if (readfile(&p->statfd, p->statpath, &p->statbuf, &p->statlen,
+		             &p->statcap) < 0) {
+			return -1;
+		}
+		p->stat = p->statbuf;
+	}
+
+	if (monotime(&p->monotonic) < 0 || walltime(&p->realtime) < 0) {
+		fprintf(stderr, "%s: Could not read the clock (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+
+	if (p->capture >= 0 && writeframe(p) < 0) {
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Parse the contents of /proc/uptime, the total system uptime and the idle
+ * time, from the nul-terminated buf into the given arguments.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int parseuptime(const char *buf, double *uptime, double *idletime)
+{
+	const char *c = buf;
+	if (parseseconds(&c, uptime) < 0 || *c++ != ' ' ||
+	    parseseconds(&c, idletime) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parse the contents of /proc/schedstat, nul-terminated in p->uptime, taken
+ * at p->monotonic, into a sample as if it were /proc/uptime: the uptime is
+ * CLOCK_MONOTONIC, and the idle time is what is left of the time of ncpu CPUs
+ * (or of the CPUs listed, if ncpu is 0) after the time spent running tasks.
+ *
+ * The seventh field of each cpuN line is the time that CPU has spent running
+ * tasks other than the idle task, in ns. The idle time is carried on from the
+ * last sample by adding the difference for each CPU, so a CPU going offline
+ * or coming online does not make it jump. Time is credited to a CPU when the
+ * task running on it is switched out, so a task which runs without a break
+ * for several intervals arrives all at once. A CPU can be busy for no more
+ * than the time since the last sample, so any more is carried over and
+ * counted in the intervals which follow, until it is used up; none of it is
+ * lost from the idle time.
+ *
+ * On success, 0 is returned, and p->ncpu is set to the CPUs listed.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int parseschedstat(struct procsource *p, double ncpu, double *uptime,
+                   double *idletime)
+{
+	const char *c = p->uptime;
+	int64_t elapsed = p->ncpu ? p->monotonic - p->lastmono : 0;
+	uint64_t busy = 0;
+	double sum = 0;
+	int n = 0;
+
+	while ((c = strstr(c, "\ncpu"))) {
+		unsigned long id = 0;
+		for (c += 4; *c >= '0' && *c <= '9'; c++) {
+			id = id * 10 + (*c - '0');
+		}
+		uint64_t v = 0;
+		for (int field = 0; field < 7; field++) {
+			if (*c++ != ' ' || *c < '0' || *c > '9') {
+				errno = EINVAL;
+				return -1;
+			}
+			for (v = 0; *c >= '0' && *c <= '9'; c++) {
+				v = v * 10 + (*c - '0');
+			}
+		}
+
+		if (id >= p->nruntime) {
+			size_t size = (id + 1) * 2;
+			uint64_t *new = realloc(p->runtime, size * sizeof(*new));
+			if (new) {
+				memset(new + p->nruntime, 0,
+				       (size - p->nruntime) * sizeof(*new));
+				p->runtime = new;
+				new = realloc(p->carry, size * sizeof(*new));
+			}
+			if (!new) {
+				fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+				        argv0, strerror(errno));
+				return -1;
+			}
+			memset(new + p->nruntime, 0,
+			       (size - p->nruntime) * sizeof(*new));
+			p->carry = new;
+			p->nruntime = size;
+		}
+		/* A CPU seen for the first time adds nothing. */
+		if (p->ncpu && p->runtime[id] && v >= p->runtime[id]) {
+			uint64_t d = v - p->runtime[id] + p->carry[id];
+			uint64_t shown = elapsed > 0 && d > (uint64_t)elapsed ?
+			                 (uint64_t)elapsed : d;
+			p->carry[id] = d - shown;
+			busy += shown;
+		}
+		p->runtime[id] = v;
+		sum += v / 1e9;
+		n++;
+	}
+	if (n == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*uptime = p->monotonic / 1e9;
+	if (ncpu == 0) {
+		ncpu = n;
+	}
+	if (p->ncpu) {
+		p->idle += (elapsed * ncpu - busy) / 1e9;
+	} else {
+		/* Before the first sample, the CPUs have been idle for the
+		 * time they have not spent running tasks since boot. */
+		p->idle = *uptime * ncpu - sum;
+		if (p->idle < 0) {
+			p->idle = 0;
+		}
+	}
+	*idletime = p->idle;
+	p->ncpu = n;
+	p->lastmono = p->monotonic;
+	return 0;
+}
+
+/*
+ * Parse a non-negative decimal number of seconds, as written by the kernel in
+ * /proc/uptime (e.g. "12345.67"), and advance *s past it.
+ *
+ * On success, 0 is returned, and value is set to the number.
+ * On failure, -1 is returned.
+ */
+int parseseconds(const char **s, double *value)
+{
+	const char *c = *s;
+	unsigned long long whole = 0;
+	unsigned long long frac = 0;
+	double scale = 1;
+
+	if (*c < '0' || *c > '9') {
+		return -1;
+	}
+	for (; *c >= '0' && *c <= '9'; c++) {
+		whole = whole * 10 + (*c - '0');
+	}
+	if (*c == '.') {
+		for (c++; *c >= '0' && *c <= '9'; c++) {
+			frac = frac * 10 + (*c - '0');
+			scale *= 10;
+		}
+	}
+
+	*value = whole + frac / scale;
+	*s = c;
+	return 0;
+}
+
+/*
+ * Join a directory and the name of a file in it.
+ *
+ * Returns the path, which should be freed, or NULL on failure.
+ */
+static char *joinpath(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	char *path = malloc(dlen + nlen + 2);
+
+	if (!path) {
+		fprintf(stderr, "%s: Could not allocate a path (%s)\n",
+		        argv0, strerror(errno));
+		return NULL;
+	}
+	memcpy(path, dir, dlen);
+	path[dlen] = '/';
+	memcpy(path + dlen + 1, name, nlen + 1);
+	return path;
+}
+
+/*
+ * Read the whole of the file at path into *buf, nul-terminated, setting *len
+ * to its length.
+ *
+ * The file is kept open in *fd between calls and read with a single pread
+ * into a buffer which grows until it can hold the whole file. The kernel
+ * generates a /proc file afresh on each read from offset 0, so a short buffer
+ * must be grown and the read repeated. If the descriptor has gone bad, it is
+ * closed and reopened once before giving up.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int readfile(int *fd, const char *path, char **buf, size_t *len,
+                    size_t *cap)
+{
+	ssize_t n = 0;
+
+	for (int tries = 0;; tries++) {
+		if (*fd < 0 && (*fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+			fprintf(stderr, "%s: Could not open %s (%s)\n",
+			        argv0, path, strerror(errno));
+			return -1;
+		}
+
+		if (!*buf || (size_t)n == *cap - 1) {
+			size_t size = *cap ? *cap * 2 : 4096;
+			char *new = realloc(*buf, size);
+			if (!new) {
+				fprintf(stderr, "%s: Could not allocate a buffer for "
+				        "%s (%s)\n", argv0, path, strerror(errno));
+				return -1;
+			}
+			*buf = new;
+			*cap = size;
+		}
+
+		n = pread(*fd, *buf, *cap - 1, 0);
+		if (n > 0 && (size_t)n < *cap - 1) {
+			break;
+		}
+		if (n > 0 || (n < 0 && errno == EINTR)) {
+			/* Too big for the buffer, or interrupted: go again. */
+			tries--;
+			if (n < 0) {
+				n = 0;
+			}
+			continue;
+		}
+		if (n == 0) {
+			errno = EIO;
+		}
+
+		/* Reopen the file once, in case the descriptor has gone stale. */
+		int err = errno;
+		close(*fd);
+		*fd = -1;
+		n = 0;
+		if (tries) {
+			fprintf(stderr, "%s: Error reading %s (%s)\n",
+			        argv0, path, strerror(err));
+			errno = err;
+			return -1;
+		}
+	}
+
+	(*buf)[n] = '\0';
+	*len = n;
+	return 0;
+}
+
+/*
+ * Take the next frame of the capture being replayed.
+ *
+ * Returns 1 if there was one, 0 at the end of the capture, or -1 if it is
+ * damaged.
+ */
+static int nextframe(struct procsource *p)
+{
+	size_t left = p->replaysize - p->replayoff;
+	struct frame f;
+
+	if (left == 0) {
+		return 0;
+	}
+	if (left < sizeof(f)) {
+		goto damaged;
+	}
+	memcpy(&f, p->replay + p->replayoff, sizeof(f));
+	left -= sizeof(f);
+	if (f.magic != CAPTURE_MAGIC || f.uptimelen > left ||
+	    f.statlen > left - f.uptimelen ||
+	    !(f.flags & FRAME_SCHEDSTAT) != !p->highres) {
+		goto damaged;
+	}
+
+	/* The uptime is copied so it can be nul-terminated; stat is parsed
+	 * with its length, so it can be used where it is. */
+	const char *data = (const char *)p->replay + p->replayoff + sizeof(f);
+	if (f.uptimelen >= p->uptimecap) {
+		char *new = realloc(p->uptimebuf, f.uptimelen + 1);
+		if (!new) {
+			fprintf(stderr, "%s: Could not allocate a buffer (%s)\n",
+			        argv0, strerror(errno));
+			return -1;
+		}
+		p->uptimebuf = new;
+		p->uptimecap = f.uptimelen + 1;
+	}
+	memcpy(p->uptimebuf, data, f.uptimelen);
+	p->uptimebuf[f.uptimelen] = '\0';
+	p->uptime = p->uptimebuf;
+	p->uptimelen = f.uptimelen;
+	p->stat = data + f.uptimelen;
+	p->statlen = f.statlen;
+	p->realtime = f.realtime;
+	p->monotonic = f.monotonic;
+
+	p->replayoff += sizeof(f) + f.uptimelen + f.statlen;
+	return 1;
+
+damaged:
+	fprintf(stderr, "%s: '%s' is damaged at byte %zu\n",
+	        argv0, p->replaypath, p->replayoff);
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Append a frame holding the sample just taken to the capture file, with a
+ * single writev.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int writeframe(struct procsource *p)
+{
+	struct frame f = {
+		.magic = CAPTURE_MAGIC,
+		.flags = p->highres ? FRAME_SCHEDSTAT : 0,
+		.uptimelen = p->uptimelen,
+		.statlen = p->statlen,
+		.realtime = p->realtime,
+		.monotonic = p->monotonic
+	};
+	struct iovec iov[3] = {
+		{ &f, sizeof(f) },
+		{ p->uptimebuf, p->uptimelen },
+		{ p->statbuf, p->statlen }
+	};
+	size_t total = sizeof(f) + p->uptimelen + p->statlen;
+
+	ssize_t n;
+	while ((n = writev(p->capture, iov, 3)) < 0 && errno == EINTR);
+	if (n >= 0 && (size_t)n != total) {
+		errno = ENOSPC;
+		n = -1;
+	}
+	if (n < 0) {
+		fprintf(stderr, "%s: Could not write '%s' (%s)\n",
+		        argv0, p->capturepath, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * Queries of the utilisation over a range of time from a history file.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+#include "cpuwatch-client.h"
+
+/* The most times to start a query again because the records it was looking
+ * at were overwritten while it ran. */
+#define QUERY_RETRIES 8
+
+/* How finely to resolve the ends of a range, as a fraction of its length,
+ * when choosing the tier of rollups to answer from. */
+#define QUERY_RESOLUTION 100
+
+/* The records of a history file, or one of its tiers of rollups, seen as a
+ * series of points in time with the running totals at each. */
+struct series {
+	const struct cpuwatch_history *h;
+	int tier;       /* -1 for the records, or the tier of rollups. */
+};
+
+static int seriesget(const struct series *s, uint64_t i, int64_t *t,
+                     double *avail, double *busy);
+static uint64_t seriescount(const struct series *s, uint64_t *oldest);
+static int search(const struct series *s, uint64_t lo, uint64_t hi, int64_t t,
+                  uint64_t *i);
+static int checkhistory(const struct cpuwatch_history *h, size_t size);
+
+/*
+ * Work out the average utilisation between the times from and to
+ * (CLOCK_REALTIME, in ns) from a mapped history file.
+ *
+ * Every record and rollup carries the running totals of the CPU time available
+ * and spent working, so the average over any range is the difference between
+ * the totals at its two ends, found with a binary search. The ends are taken
+ * from the tier of rollups (or the records) chosen by cpuwatch_history_pick()
+ * to resolve them to within 1/QUERY_RESOLUTION of the range, so a query costs
+ * O(log n) however long the range.
+ *
+ * On success, 0 is returned, and util is set to the percentage.
+ * On failure, -1 is returned, and errno is set to ENODATA if the file holds
+ * nothing about the range, or EAGAIN if the writer kept overwriting it.
+ */
+int queryhistory(const struct cpuwatch_history *h, int64_t from, int64_t to,
+                 double *util)
+{
+	int64_t step = (to - from) / QUERY_RESOLUTION;
+	struct series s = { h, cpuwatch_history_pick(h, from, step) };
+
+	for (int tries = 0; tries < QUERY_RETRIES; tries++) {
+		uint64_t lo, hi = seriescount(&s, &lo);
+		uint64_t i, j;
+		int64_t t;
+		double a0, b0, a1, b1;
+
+		/* Find the points at or just before each end of the range. */
+		int found = search(&s, lo, hi, to, &j);
+		if (found < 0) {
+			continue;
+		}
+		if (!found) {
+			errno = ENODATA; /* The range ends before the history. */
+			return -1;
+		}
+		found = search(&s, lo, hi, from, &i);
+		if (found < 0) {
+			continue;
+		}
+		if (!found) {
+			i = lo; /* The range starts before the history. */
+		}
+
+		/* A range within a single interval gets the whole interval. */
+		if (j == i) {
+			if (i + 1 >= hi) {
+				errno = ENODATA;
+				return -1;
+			}
+			j = i + 1;
+		}
+
+		if (seriesget(&s, i, &t, &a0, &b0) < 0 ||
+		    seriesget(&s, j, &t, &a1, &b1) < 0) {
+			continue;
+		}
+		*util = a1 > a0 ? 100 * (b1 - b0) / (a1 - a0) : 0;
+		return 0;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * The "query" subcommand: print the average utilisation between two times
+ * from a history file written with --history. Given only the file, it reads
+ * a pair of times from each line of stdin, and prints an answer for each.
+ *
+ * Returns the exit status for the program.
+ */
+int querycmd(int argc, char **argv)
+{
+	if (argc != 2 && argc != 4) {
+		fprintf(stderr, "usage: %s query FILE [FROM TO]\n"
+		        "Times are seconds since the epoch, HH:MM[:SS] today, "
+		        "YYYY-MM-DD HH:MM[:SS] or now.\n", argv0);
+		return -1;
+	}
+
+	int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+		        argv0, argv[1], strerror(errno));
+		return -1;
+	}
+	const struct cpuwatch_history *h = MAP_FAILED;
+	if ((size_t)sb.st_size >= CPUWATCH_HISTORY_HEADER) {
+		h = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (h == MAP_FAILED || checkhistory(h, sb.st_size) < 0) {
+		fprintf(stderr, "%s: '%s' is not a history file written by this "
+		        "version of cpuwatch\n", argv0, argv[1]);
+		return -1;
+	}
+
+	char line[256];
+	const char *c;
+	int status = 0;
+	for (int n = 1; ; n++) {
+		if (argc == 4) {
+			if (n > 1) {
+				break;
+			}
+			snprintf(line, sizeof(line), "%s %s", argv[2], argv[3]);
+		} else if (!fgets(line, sizeof(line), stdin)) {
+			break;
+		}
+
+		int64_t from, to;
+		double util;
+		c = line;
+		if (parsetime(&c, &from) < 0 || parsetime(&c, &to) < 0 ||
+		    (*c && *c != '\n') || to < from) {
+			fprintf(stderr, "%s: Could not understand query %d: %s%s",
+			        argv0, n, line, strchr(line, '\n') ? "" : "\n");
+			printf("-\n");
+			status = -1;
+			continue;
+		}
+		if (queryhistory(h, from, to, &util) < 0) {
+			printf("-\n");
+			continue;
+		}
+		printf("%.1f%%\n", util);
+	}
+
+	return status;
+}
+
+/*
+ * Check that the header of a mapped history file of size bytes is one this
+ * version of cpuwatch writes, and that the records and each tier of rollups it
+ * describes lie within the file, before anything is read from them.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned.
+ */
+static int checkhistory(const struct cpuwatch_history *h, size_t size)
+{
+	if (memcmp(h->magic, CPUWATCH_HISTORY_MAGIC, sizeof(h->magic)) ||
+	    h->version != CPUWATCH_HISTORY_VERSION ||
+	    h->recsize != sizeof(struct cpuwatch_record) ||
+	    h->rollupsize != sizeof(struct cpuwatch_rollup) ||
+	    h->ntiers > CPUWATCH_HISTORY_MAXTIERS) {
+		return -1;
+	}
+	/* Compared by division, so a corrupt capacity cannot overflow. */
+	if (!h->capacity ||
+	    h->capacity > (size - CPUWATCH_HISTORY_HEADER) / h->recsize) {
+		return -1;
+	}
+	for (uint32_t t = 0; t < h->ntiers; t++) {
+		const struct cpuwatch_tier *tier = &h->tiers[t];
+		if (!tier->capacity || tier->period <= 0 || tier->offset > size ||
+		    tier->capacity > (size - tier->offset) / h->rollupsize) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read point i of a series: its time (the end of the period, for a rollup)
+ * and the running totals there.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, if it is not (or no longer) in the file.
+ */
+static int seriesget(const struct series *s, uint64_t i, int64_t *t,
+                     double *avail, double *busy)
+{
+	if (s->tier < 0) {
+		struct cpuwatch_record rec;
+		if (cpuwatch_history_get(s->h, i, &rec) < 0) {
+			return -1;
+		}
+		*t = rec.realtime;
+		*avail = rec.avail;
+		*busy = rec.busy;
+		return 0;
+	}
+
+	struct cpuwatch_rollup r;
+	if (cpuwatch_history_rollup(s->h, s->tier, i, &r) < 0) {
+		return -1;
+	}
+	*t = r.start + s->h->tiers[s->tier].period;
+	*avail = r.avail;
+	*busy = r.busy;
+	return 0;
+}
+
+/*
+ * Find the points of a series in the file, which are numbered from oldest
+ * up to the value returned. The oldest slot is left out, as the writer may
+ * be about to overwrite it.
+ */
+static uint64_t seriescount(const struct series *s, uint64_t *oldest)
+{
+	uint64_t count, cap;
+
+	if (s->tier < 0) {
+		count = __atomic_load_n(&s->h->count, __ATOMIC_ACQUIRE);
+		cap = s->h->capacity;
+	} else {
+		count = __atomic_load_n(&s->h->tiers[s->tier].count,
+		                        __ATOMIC_ACQUIRE);
+		cap = s->h->tiers[s->tier].capacity;
+	}
+	*oldest = count > cap ? count - cap + 1 : 0;
+	return count;
+}
+
+/*
+ * Binary search points [lo, hi) of a series, which are in order of time, for
+ * the last at or before time t.
+ *
+ * Returns 1 with *i set if there is one, 0 if there is none, or -1 if a point
+ * was overwritten during the search.
+ */
+static int search(const struct series *s, uint64_t lo, uint64_t hi, int64_t t,
+                  uint64_t *i)
+{
+	int64_t when;
+	double a, b;
+	int found = 0;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (seriesget(s, mid, &when, &a, &b) < 0) {
+			return -1;
+		}
+		if (when <= t) {
+			*i = mid;
+			found = 1;
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return found;
+}
+
+/*
+ * Parse a time from *s, skipping spaces before it, and advance *s past it.
+ * A time is one of:
+ *  now
+ *  seconds since the epoch, e.g. 1660608000 or 1660608000.5
+ *  HH:MM or HH:MM:SS, today in local time
+ *  YYYY-MM-DD HH:MM[:SS] (or with a T between them), in local time
+ *
+ * On success, 0 is returned, and ns is set to the time in ns since the epoch.
+ * On failure, -1 is returned.
+ */
+int parsetime(const char **s, int64_t *ns)
+{
+	const char *c = *s;
+	long long v[6] = { 0 };
+	int digits = 0;
+
+	while (*c == ' ' || *c == '\t' || *c == ',') {
+		c++;
+	}
+	if (!strncmp(c, "now", 3)) {
+		*s = c + 3;
+		return walltime(ns);
+	}
+
+	for (; *c >= '0' && *c <= '9' && digits < 19; c++, digits++) {
+		v[0] = v[0] * 10 + (*c - '0');
+	}
+	if (!digits) {
+		return -1;
+	}
+
+	if (*c != '-' && *c != ':') {
+		/* Seconds since the epoch, perhaps with a fraction, which must
+		 * fit in an int64_t once in ns. */
+		int64_t frac = 0, scale = 1000000000;
+		if (v[0] > INT64_MAX / 1000000000 - 1) {
+			return -1;
+		}
+		if (*c == '.') {
+			for (c++; *c >= '0' && *c <= '9'; c++) {
+				if (scale > 1) {
+					scale /= 10;
+					frac += (*c - '0') * scale;
+				}
+			}
+		}
+		*ns = v[0] * 1000000000 + frac;
+		*s = c;
+		return 0;
+	}
+
+	/* A date and time, or a time today, to be read as a struct tm. */
+	time_t now = time(NULL);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	int n = 1;
+	if (*c == '-') {
+		/* YYYY-MM-DD, then a space or T, then the time. */
+		for (; n < 3 && *c == '-'; n++) {
+			for (c++; *c >= '0' && *c <= '9'; c++) {
+				v[n] = v[n] * 10 + (*c - '0');
+			}
+		}
+		if (n != 3 || (*c != ' ' && *c != 'T')) {
+			return -1;
+		}
+		tm.tm_year = v[0] - 1900;
+		tm.tm_mon = v[1] - 1;
+		tm.tm_mday = v[2];
+		for (c++, v[0] = 0, digits = 0; *c >= '0' && *c <= '9';
+		     c++, digits++) {
+			v[0] = v[0] * 10 + (*c - '0');
+		}
+		if (!digits || *c != ':') {
+			return -1;
+		}
+		v[1] = 0;
+		v[2] = 0;
+	}
+
+	/* HH:MM or HH:MM:SS, with the hours in v[0]. */
+	for (n = 1; n < 3 && *c == ':'; n++) {
+		for (c++; *c >= '0' && *c <= '9'; c++) {
+			v[n] = v[n] * 10 + (*c - '0');
+		}
+	}
+	if (v[0] > 23 || v[1] > 59 || v[2] > 60) {
+		return -1;
+	}
+	tm.tm_hour = v[0];
+	tm.tm_min = v[1];
+	tm.tm_sec = v[2];
+	tm.tm_isdst = -1;
+
+	time_t t = mktime(&tm);
+	if (t == (time_t)-1) {
+		return -1;
+	}
+	*ns = (int64_t)t * 1000000000;
+	*s = c;
+	return 0;
+}
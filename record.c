@@ -0,0 +1,520 @@
+/*
+ * Compressed recording of the per-CPU counters from /proc/stat.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+
+/*
+ * A recording is a sequence of blocks, each holding up to RECORD_POINTS
+ * samples of every counter of every CPU. A block starts with a 16 byte header,
+ * all little-endian:
+ *
+ *  magic   4 bytes  "CWRB"
+ *  length  4 bytes  bytes of data following the header
+ *  points  4 bytes  number of samples in the block
+ *  ncpu    2 bytes  number of CPUs
+ *  nmodes  2 bytes  number of counters for each CPU (NMODES)
+ *
+ * The data is a stream of bits, most significant first. The first sample
+ * gives the time in microseconds in 64 bits, the number of each CPU in 16 bits
+ * and every counter in 64 bits. Each later sample gives the delta-of-delta of
+ * the time and of each counter, that is the change in how much it has changed,
+ * in the variable-length code written by putint(). Counters which go up
+ * steadily (idle time on an idle CPU) or not at all (guest time) then take a
+ * single bit, and a sample typically needs a few bytes for each CPU.
+ *
+ * A new block is started if the list of CPUs changes.
+ */
+
+#define RECORD_MAGIC 0x42525743 /* "CWRB" */
+#define RECORD_HEADER 16
+#define RECORD_POINTS 1024
+#define RECORD_SECONDS 60
+
+static void putbits(struct bitwriter *w, uint64_t v, int n);
+static void putint(struct bitwriter *w, int64_t v);
+static void flushbits(struct bitwriter *w);
+static void putle(unsigned char *p, uint64_t v, int n);
+static uint64_t getle(const unsigned char *p, int n);
+static void putbe(unsigned char *p, uint64_t v);
+static uint64_t getbe(const unsigned char *p);
+
+/*
+ * Open the file at path to append a recording to.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int openrecord(struct record *r, const char *path)
+{
+	memset(r, 0, sizeof(*r));
+	r->path = path;
+	r->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (r->fd < 0) {
+		fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+		        argv0, path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add a sample of the counters in st, taken at the given time, to the current
+ * block, writing the block out first if it is full or the CPUs have changed.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int recordstat(struct record *r, const struct cpustat *st, int64_t realtime)
+{
+	int64_t t = realtime / 1000;
+	int n = st->ncpu;
+
+	if (r->points && (r->points == RECORD_POINTS || n != r->ncpu ||
+	    t - r->first >= RECORD_SECONDS * 1000000LL ||
+	    memcmp(st->id, r->id, n * sizeof(*st->id)))) {
+		if (flushrecord(r) < 0) {
+			return -1;
+		}
+	}
+
+	/* Make room to keep the previous values and their deltas. */
+	if (n > r->cap) {
+		/* Each is kept as soon as it is moved, so that neither is left
+		 * dangling if the other cannot be. */
+		uint64_t *v = realloc(r->last, 2 * NMODES * n * sizeof(*v));
+		if (v) {
+			r->last = v;
+		}
+		int *id = v ? realloc(r->id, n * sizeof(*id)) : NULL;
+		if (!id) {
+			fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+			        argv0, strerror(errno));
+			return -1;
+		}
+		r->id = id;
+		r->cap = n;
+	}
+	uint64_t *last = r->last;
+	int64_t *delta = (int64_t *)(r->last + NMODES * n);
+
+	struct bitwriter *w = &r->bits;
+	if (r->points == 0) {
+		r->ncpu = n;
+		r->first = t;
+		w->out.len = 0;
+		putbits(w, t, 64);
+		for (int i = 0; i < n; i++) {
+			putbits(w, st->id[i], 16);
+		}
+		for (int m = 0; m < NMODES; m++) {
+			for (int i = 0; i < n; i++) {
+				uint64_t v = st->mode[m][i];
+				putbits(w, v, 64);
+				last[m * n + i] = v;
+				delta[m * n + i] = 0;
+			}
+		}
+		memcpy(r->id, st->id, n * sizeof(*st->id));
+		r->lasttime = t;
+		r->timedelta = 0;
+	} else {
+		int64_t d = t - r->lasttime;
+		putint(w, d - r->timedelta);
+		r->timedelta = d;
+		r->lasttime = t;
+
+		for (int m = 0; m < NMODES; m++) {
+			const uint64_t *v = st->mode[m];
+			uint64_t *l = &last[m * n];
+			int64_t *dl = &delta[m * n];
+			for (int i = 0; i < n; i++) {
+				int64_t dv = (int64_t)(v[i] - l[i]);
+				putint(w, dv - dl[i]);
+				dl[i] = dv;
+				l[i] = v[i];
+			}
+		}
+	}
+	r->points++;
+
+	if (w->out.err) {
+		fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write out the current block, if it holds any samples.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int flushrecord(struct record *r)
+{
+	if (!r->points) {
+		return 0;
+	}
+
+	struct bitwriter *w = &r->bits;
+	flushbits(w);
+
+	unsigned char hdr[RECORD_HEADER];
+	putle(hdr, RECORD_MAGIC, 4);
+	putle(hdr + 4, w->out.len, 4);
+	putle(hdr + 8, r->points, 4);
+	putle(hdr + 12, r->ncpu, 2);
+	putle(hdr + 14, NMODES, 2);
+	r->points = 0;
+
+	if (write(r->fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(r->fd, w->out.data, w->out.len) != (ssize_t)w->out.len) {
+		fprintf(stderr, "%s: Could not write '%s' (%s)\n",
+		        argv0, r->path, strerror(errno));
+		return -1;
+	}
+	w->out.len = 0;
+	return 0;
+}
+
+/*
+ * Decode one block of a recording from buf, which holds len bytes, calling
+ * fn for each sample with the time in microseconds and the counters, which are
+ * in the same layout as struct cpustat (st->mode[m][i]).
+ *
+ * On success, the number of bytes the block took up is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+ssize_t decodeblock(const unsigned char *buf, size_t len, struct cpustat *st,
+                    int (*fn)(int64_t t, const struct cpustat *st, void *arg),
+                    void *arg)
+{
+	if (len < RECORD_HEADER || getle(buf, 4) != RECORD_MAGIC) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t size = getle(buf + 4, 4);
+	uint32_t points = getle(buf + 8, 4);
+	int n = getle(buf + 12, 2);
+	int nmodes = getle(buf + 14, 2);
+	if (size > len - RECORD_HEADER || nmodes != NMODES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Each array of counters is followed by room for their deltas. */
+	if (n > st->cap) {
+		int *id = realloc(st->id, n * sizeof(*id));
+		if (!id) {
+			return -1;
+		}
+		st->id = id;
+		for (int m = 0; m < NMODES; m++) {
+			uint64_t *v = realloc(st->mode[m], 2 * n * sizeof(*v));
+			if (!v) {
+				return -1;
+			}
+			st->mode[m] = v;
+		}
+		st->cap = n;
+	}
+	st->ncpu = n;
+
+	struct bitreader r = { buf + RECORD_HEADER, buf + RECORD_HEADER + size,
+	                       0, 0, 0 };
+	int64_t t = 0, dt = 0;
+	for (uint32_t p = 0; p < points; p++) {
+		if (p == 0) {
+			t = getbits(&r, 64);
+			for (int i = 0; i < n; i++) {
+				st->id[i] = getbits(&r, 16);
+			}
+			for (int m = 0; m < NMODES; m++) {
+				uint64_t *v = st->mode[m];
+				int64_t *d = (int64_t *)(v + st->cap);
+				for (int i = 0; i < n; i++) {
+					v[i] = getbits(&r, 64);
+					d[i] = 0;
+				}
+			}
+		} else {
+			dt += getint(&r);
+			t += dt;
+			for (int m = 0; m < NMODES; m++) {
+				uint64_t *v = st->mode[m];
+				int64_t *d = (int64_t *)(v + st->cap);
+				for (int i = 0; i < n; i++) {
+					d[i] += getint(&r);
+					v[i] += d[i];
+				}
+			}
+		}
+		if (r.overrun) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (int m = 0; m < NMODES; m++) {
+			st->all[m] = 0;
+			for (int i = 0; i < n; i++) {
+				st->all[m] += st->mode[m][i];
+			}
+		}
+		if (fn && fn(t, st, arg) < 0) {
+			return -1;
+		}
+	}
+
+	return RECORD_HEADER + size;
+}
+
+/*
+ * Print one decoded sample as lines of comma-separated values.
+ */
+static int printsample(int64_t t, const struct cpustat *st, void *arg)
+{
+	FILE *out = arg;
+	for (int i = 0; i < st->ncpu; i++) {
+		fprintf(out, "%lld.%06lld,%d", (long long)(t / 1000000),
+		        (long long)(t % 1000000), st->id[i]);
+		for (int m = 0; m < NMODES; m++) {
+			fprintf(out, ",%llu", (unsigned long long)st->mode[m][i]);
+		}
+		fputc('\n', out);
+	}
+	return 0;
+}
+
+/*
+ * The "decode" subcommand: print a recording made with --record as
+ * comma-separated values, one line for each CPU in each sample.
+ *
+ * Returns the exit status for the program.
+ */
+int decodecmd(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s decode FILE\n", argv0);
+		return -1;
+	}
+
+	int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+	struct stat sb;
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		fprintf(stderr, "%s: Could not open '%s' (%s)\n",
+		        argv0, argv[1], strerror(errno));
+		return -1;
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	const unsigned char *buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+	                                fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		fprintf(stderr, "%s: Could not map '%s' (%s)\n",
+		        argv0, argv[1], strerror(errno));
+		return -1;
+	}
+
+	printf("time,cpu");
+	for (int m = 0; m < NMODES; m++) {
+		printf(",%s", modenames[m]);
+	}
+	printf("\n");
+
+	struct cpustat st;
+	memset(&st, 0, sizeof(st));
+	size_t off = 0;
+	while (off < (size_t)sb.st_size) {
+		ssize_t n = decodeblock(buf + off, sb.st_size - off, &st,
+		                        printsample, stdout);
+		if (n < 0) {
+			fprintf(stderr, "%s: '%s' is damaged at byte %zu\n",
+			        argv0, argv[1], off);
+			return -1;
+		}
+		off += n;
+	}
+	return 0;
+}
+
+/*
+ * Append the low n bits of v to the stream.
+ */
+static void putbits(struct bitwriter *w, uint64_t v, int n)
+{
+	if (n < 64) {
+		v &= ((uint64_t)1 << n) - 1;
+	}
+	while (n) {
+		int room = 64 - w->nbits;
+		int k = n < room ? n : room;
+		uint64_t part = k == 64 ? v : v >> (n - k);
+		if (k < 64) {
+			part &= ((uint64_t)1 << k) - 1;
+		}
+		w->acc = k == 64 ? part : (w->acc << k) | part;
+		w->nbits += k;
+		n -= k;
+		if (w->nbits == 64) {
+			unsigned char bytes[8];
+			putbe(bytes, w->acc);
+			bufput(&w->out, (const char *)bytes, 8);
+			w->acc = 0;
+			w->nbits = 0;
+		}
+	}
+}
+
+/*
+ * Append a signed integer in a variable-length code, which favours values
+ * close to 0:
+ *  0                 '0'
+ *  -4 to 3           '10' and 3 bits
+ *  -64 to 63         '110' and 7 bits
+ *  -2048 to 2047     '1110' and 12 bits
+ *  32 bit values     '11110' and 32 bits
+ *  anything else     '11111' and 64 bits
+ */
+static void putint(struct bitwriter *w, int64_t v)
+{
+	if (v == 0) {
+		putbits(w, 0, 1);
+	} else if (v >= -4 && v < 4) {
+		putbits(w, 0x2, 2);
+		putbits(w, v, 3);
+	} else if (v >= -64 && v < 64) {
+		putbits(w, 0x6, 3);
+		putbits(w, v, 7);
+	} else if (v >= -2048 && v < 2048) {
+		putbits(w, 0xe, 4);
+		putbits(w, v, 12);
+	} else if (v >= INT32_MIN && v <= INT32_MAX) {
+		putbits(w, 0x1e, 5);
+		putbits(w, v, 32);
+	} else {
+		putbits(w, 0x1f, 5);
+		putbits(w, v, 64);
+	}
+}
+
+/*
+ * Write out any bits left over, padding the last byte with zeros.
+ */
+static void flushbits(struct bitwriter *w)
+{
+	unsigned char bytes[8];
+	int n = (w->nbits + 7) / 8;
+
+	if (!w->nbits) {
+		return;
+	}
+	putbe(bytes, w->acc << (64 - w->nbits));
+	bufput(&w->out, (const char *)bytes, n);
+	w->acc = 0;
+	w->nbits = 0;
+}
+
+/*
+ * Read n bits (1 to 64) from the stream. Reading past the end gives zeros and
+ * sets r->overrun.
+ */
+uint64_t getbits(struct bitreader *r, int n)
+{
+	uint64_t v = 0;
+
+	while (n) {
+		if (r->nbits == 0) {
+			if (r->p == r->end) {
+				r->overrun = 1;
+				return 0;
+			}
+			if (r->end - r->p >= 8) {
+				r->acc = getbe(r->p);
+				r->p += 8;
+				r->nbits = 64;
+			} else {
+				r->acc = (uint64_t)*r->p++ << 56;
+				r->nbits = 8;
+			}
+		}
+		int k = n < r->nbits ? n : r->nbits;
+		uint64_t part = r->acc >> (64 - k);
+		r->acc = k == 64 ? 0 : r->acc << k;
+		r->nbits -= k;
+		v = k == 64 ? part : (v << k) | part;
+		n -= k;
+	}
+	return v;
+}
+
+/*
+ * Read a signed integer written by putint().
+ */
+int64_t getint(struct bitreader *r)
+{
+	static const int widths[] = { 3, 7, 12, 32, 64 };
+	int ones = 0;
+
+	if (!getbits(r, 1)) {
+		return 0;
+	}
+	while (ones < 4 && getbits(r, 1)) {
+		ones++;
+	}
+	int n = widths[ones];
+	uint64_t v = getbits(r, n);
+	if (n < 64 && (v >> (n - 1)) & 1) {
+		v |= ~(uint64_t)0 << n;
+	}
+	return (int64_t)v;
+}
+
+static void putle(unsigned char *p, uint64_t v, int n)
+{
+	for (int i = 0; i < n; i++) {
+		p[i] = v >> (8 * i);
+	}
+}
+
+static uint64_t getle(const unsigned char *p, int n)
+{
+	uint64_t v = 0;
+	for (int i = n; i--;) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static void putbe(unsigned char *p, uint64_t v)
+{
+	for (int i = 8; i--;) {
+		p[i] = v;
+		v >>= 8;
+	}
+}
+
+static uint64_t getbe(const unsigned char *p)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
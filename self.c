@@ -0,0 +1,185 @@
+/*
+ * Measurement of what cpuwatch itself costs, and how closely it keeps to its
+ * schedule.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+
+const char *const stagenames[NSTAGES] = {
+	"read", "parse", "compute", "write"
+};
+
+static int readio(unsigned long long *syscr, unsigned long long *syscw);
+
+/*
+ * Start measuring from now.
+ */
+void selfinit(struct selfstats *self)
+{
+	memset(self, 0, sizeof(*self));
+	monotime(&self->started);
+	self->mark = self->started;
+}
+
+/*
+ * Note that the process has woken up for a sample, late ns after the deadline.
+ * The lateness goes in a histogram with a bucket for each power of 2 in
+ * microseconds, and the time spent in the stages of the sample is measured
+ * from here.
+ */
+void selfwake(struct selfstats *self, int64_t late)
+{
+	int b = 0;
+
+	if (late < 0) {
+		late = 0;
+	}
+	for (int64_t us = late / 1000; us && b < NLATE - 1; us >>= 1) {
+		b++;
+	}
+	self->late[b]++;
+	self->latesum += late;
+	if (late > self->latemax) {
+		self->latemax = late;
+	}
+	self->wakeups++;
+	monotime(&self->mark);
+}
+
+/*
+ * Add the time since the last mark to the given stage, and mark now.
+ */
+void selfstage(struct selfstats *self, enum stage stage)
+{
+	int64_t now;
+
+	monotime(&now);
+	self->stage[stage] += now - self->mark;
+	self->mark = now;
+}
+
+/*
+ * Write a report of the figures so far to b, one "name value" pair to a line:
+ * the CPU time used, context switches, read and write system calls (as counted
+ * in /proc/self/io, if the kernel keeps count) and the time spent in each
+ * stage, per sample, the outputs dropped by writers which fell behind, and
+ * the lateness of wakeups with its histogram.
+ */
+void selfreport(struct selfstats *self, struct buf *b, unsigned long overruns,
+                unsigned long overflows)
+{
+	char line[128];
+	int64_t now;
+	struct timespec cpu;
+	struct rusage ru;
+	unsigned long long syscr, syscw;
+	double n = self->samples ? self->samples : 1;
+
+	monotime(&now);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	getrusage(RUSAGE_SELF, &ru);
+	double elapsed = (now - self->started) / 1e9;
+	double cpusecs = cpu.tv_sec + cpu.tv_nsec / 1e9;
+
+	snprintf(line, sizeof(line), "samples %lu\n", self->samples);
+	bufputs(b, line);
+	snprintf(line, sizeof(line), "elapsed_seconds %.3f\n", elapsed);
+	bufputs(b, line);
+	snprintf(line, sizeof(line), "cpu_seconds %.6f\n", cpusecs);
+	bufputs(b, line);
+	snprintf(line, sizeof(line), "cpu_percent %.4f\n",
+	         elapsed > 0 ? 100 * cpusecs / elapsed : 0);
+	bufputs(b, line);
+	snprintf(line, sizeof(line), "cpu_us_per_sample %.2f\n",
+	         cpusecs / n * 1e6);
+	bufputs(b, line);
+	snprintf(line, sizeof(line), "context_switches %ld voluntary %ld "
+	         "involuntary\n", ru.ru_nvcsw, ru.ru_nivcsw);
+	bufputs(b, line);
+	if (readio(&syscr, &syscw) == 0) {
+		snprintf(line, sizeof(line), "syscalls_per_sample %.2f read %.2f "
+		         "write\n", syscr / n, syscw / n);
+		bufputs(b, line);
+	}
+	for (int s = 0; s < NSTAGES; s++) {
+		snprintf(line, sizeof(line), "stage_%s_us %.2f\n", stagenames[s],
+		         self->stage[s] / n / 1e3);
+		bufputs(b, line);
+	}
+
+	snprintf(line, sizeof(line), "missed_deadlines %lu\n", overruns);
+	bufputs(b, line);
+	snprintf(line, sizeof(line), "dropped_outputs %lu\n", overflows);
+	bufputs(b, line);
+	snprintf(line, sizeof(line), "late_mean_us %.2f\nlate_max_us %.2f\n",
+	         self->wakeups ? self->latesum / 1e3 / self->wakeups : 0,
+	         self->latemax / 1e3);
+	bufputs(b, line);
+	bufputs(b, "late_histogram_us");
+	for (int i = 0; i < NLATE; i++) {
+		if (!self->late[i]) {
+			continue;
+		}
+		/* Bucket i holds up to 2^i us, and the last all the rest. */
+		if (i == NLATE - 1) {
+			snprintf(line, sizeof(line), " >=%lu:%lu", 1UL << (i - 1),
+			         self->late[i]);
+		} else {
+			snprintf(line, sizeof(line), " <%lu:%lu", 1UL << i,
+			         self->late[i]);
+		}
+		bufputs(b, line);
+	}
+	bufputs(b, "\n");
+}
+
+/*
+ * Read the counts of read and write system calls made by this process from
+ * /proc/self/io, which is kept open.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, if the counts are not available.
+ */
+static int readio(unsigned long long *syscr, unsigned long long *syscw)
+{
+	static int fd = -2;
+	char buf[512];
+
+	if (fd == -2) {
+		fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+
+	char *r = strstr(buf, "syscr: ");
+	char *w = strstr(buf, "syscw: ");
+	if (!r || !w) {
+		return -1;
+	}
+	*syscr = 0;
+	for (r += 7; *r >= '0' && *r <= '9'; r++) {
+		*syscr = *syscr * 10 + (*r - '0');
+	}
+	*syscw = 0;
+	for (w += 7; *w >= '0' && *w <= '9'; w++) {
+		*syscw = *syscw * 10 + (*w - '0');
+	}
+	return 0;
+}
@@ -0,0 +1,778 @@
+/*
+ * A server which answers queries about the latest sample and the history on a
+ * Unix socket, sends each sample to subscribers, and serves metrics over HTTP,
+ * from a thread of its own.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+#include "cpuwatch-client.h"
+
+/* The most events to take from epoll at once. */
+#define SERVER_EVENTS 64
+
+/* The longest request line, and HTTP request head, and the most reply text to
+ * hold for a client which is not reading it before giving up on it. */
+#define SERVER_LINE 256
+#define SERVER_HEAD 4096
+#define SERVER_BACKLOG (1 << 20)
+
+#define VIEW_FRESH 4 /* Set in server.middle when it holds a newer view. */
+
+/* A client connected to the server. */
+struct client {
+	int fd;
+	char in[SERVER_HEAD];  /* The request being read, */
+	size_t inlen;
+	struct buf out;        /* and the replies waiting to be written, */
+	size_t outoff;         /* from here. */
+	int writing;           /* Set while waiting for room to write. */
+	int subscriber;        /* Set if it is sent updates rather than asking, */
+	int http;              /* or if it speaks HTTP. */
+	int closing;           /* Set to close it once its replies are sent. */
+	int dropped;           /* Set once closed, until it is freed. */
+	unsigned behind;       /* Updates it has not had room for. */
+	struct client *prev;   /* Every client of its kind, to close them on the */
+	struct client *next;   /* way out. */
+};
+
+static int listenon(struct server *srv, const char *path, int type, int *fd);
+static int listenhttp(struct server *srv, int port);
+static int startlistening(struct server *srv, int *fd, const void *addr,
+                          socklen_t len, const char *name);
+static void *serverloop(void *arg);
+static void acceptclients(struct server *srv, int *listenfd);
+static int readclient(struct server *srv, struct client *c);
+static int flushclient(struct server *srv, struct client *c);
+static int wantwrite(struct server *srv, struct client *c, int writing);
+static void dropclient(struct server *srv, struct client *c);
+static void freedropped(struct server *srv);
+static const struct view *takeview(struct server *srv);
+static void sendupdates(struct server *srv);
+static int sendupdate(struct server *srv, struct client *c);
+static void answer(struct server *srv, const char *req, struct buf *b);
+static char *headend(char *nl, const char *end);
+static void reply(struct buf *b, const char *status, const char *type,
+                  const char *body, size_t len, int headonly, int closing);
+static int answerhttp(struct server *srv, char *req, struct buf *b);
+
+/*
+ * Start serving, from a thread of its own, queries on a Unix stream socket at
+ * querypath, subscriptions on a Unix seqpacket socket at subpath, and metrics
+ * over HTTP on httpport on the loopback interface; paths which are NULL and a
+ * port which is 0 are not served. h is the history file to answer queries
+ * about ranges of time from, or NULL. Any files already at the paths are
+ * replaced.
+ *
+ * The sampling loop hands each new view of the latest sample to the server
+ * through three buffers: it renders into the back one, then swaps it with the
+ * middle one, and the server swaps the middle one for its front one when it
+ * is newer. Each buffer is only ever touched by the side which holds it, so
+ * neither side waits for the other, and the sampling loop makes no system
+ * calls to publish a view, apart from waking the server when there are
+ * subscribers to send it to.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int startserver(struct server *srv, const char *querypath,
+                const char *subpath, int httpport,
+                const struct cpuwatch_history *h)
+{
+	memset(srv, 0, sizeof(*srv));
+	srv->history = h;
+	srv->back = 0;
+	srv->middle = 1;
+	srv->front = 2;
+	srv->listen = srv->sublisten = srv->httplisten = -1;
+	srv->epoll = srv->wake = srv->spare = -1;
+
+	/* A descriptor is kept spare, so that when there are none left a
+	 * client can still be accepted and closed rather than left waiting. */
+	srv->epoll = epoll_create1(EPOLL_CLOEXEC);
+	srv->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	srv->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN };
+	ev.data.ptr = &srv->wake;
+	if (srv->epoll < 0 || srv->wake < 0 ||
+	    epoll_ctl(srv->epoll, EPOLL_CTL_ADD, srv->wake, &ev) < 0) {
+		fprintf(stderr, "%s: Could not set up the server (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+	for (int i = 0; i < 3; i++) {
+		srv->views[i].update = calloc(1, sizeof(struct cpuwatch_update));
+		if (!srv->views[i].update) {
+			fprintf(stderr, "%s: Could not allocate memory (%s)\n",
+			        argv0, strerror(errno));
+			return -1;
+		}
+		srv->views[i].update->magic = CPUWATCH_UPDATE_MAGIC;
+		srv->views[i].update->size = sizeof(struct cpuwatch_update);
+	}
+
+	if ((querypath &&
+	     listenon(srv, querypath, SOCK_STREAM, &srv->listen) < 0) ||
+	    (subpath &&
+	     listenon(srv, subpath, SOCK_SEQPACKET, &srv->sublisten) < 0) ||
+	    (httpport && listenhttp(srv, httpport) < 0)) {
+		return -1;
+	}
+	srv->querypath = querypath;
+	srv->subpath = subpath;
+
+	/* Signals are left to the sampling loop. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&srv->thread, NULL, serverloop, srv);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		fprintf(stderr, "%s: Could not start the server thread (%s)\n",
+		        argv0, strerror(err));
+		errno = err;
+		return -1;
+	}
+	srv->running = 1;
+	return 0;
+}
+
+/*
+ * Listen on a Unix socket of the given type at path, replacing any file
+ * there, and have the server thread wait for clients on it.
+ *
+ * On success, 0 is returned, and *fd is set to the socket.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int listenon(struct server *srv, const char *path, int type, int *fd)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: '%s' is too long for a socket path\n",
+		        argv0, path);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	*fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	return startlistening(srv, fd, &addr, sizeof(addr), path);
+}
+
+/*
+ * Listen for HTTP clients on the given TCP port of the loopback interface,
+ * and have the server thread wait for them.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int listenhttp(struct server *srv, int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr = { htonl(INADDR_LOOPBACK) }
+	};
+	char name[32];
+	int one = 1;
+
+	snprintf(name, sizeof(name), "127.0.0.1:%d", port);
+	srv->httplisten = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+	                         SOCK_CLOEXEC, 0);
+	if (srv->httplisten >= 0) {
+		setsockopt(srv->httplisten, SOL_SOCKET, SO_REUSEADDR, &one,
+		           sizeof(one));
+	}
+	return startlistening(srv, &srv->httplisten, &addr, sizeof(addr), name);
+}
+
+/*
+ * Bind the socket *fd, if it was created, to addr, listen on it, and have the
+ * server thread wait for clients on it. name is what to call it in errors.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int startlistening(struct server *srv, int *fd, const void *addr,
+                          socklen_t len, const char *name)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	ev.data.ptr = fd;
+	if (*fd < 0 ||
+	    bind(*fd, addr, len) < 0 ||
+	    listen(*fd, SOMAXCONN) < 0 ||
+	    epoll_ctl(srv->epoll, EPOLL_CTL_ADD, *fd, &ev) < 0) {
+		fprintf(stderr, "%s: Could not listen on '%s' (%s)\n",
+		        argv0, name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the view to render the latest sample into, emptied, for publishview.
+ */
+struct view *backview(struct server *srv)
+{
+	struct view *v = &srv->views[srv->back];
+	v->util.len = 0;
+	v->cpus.len = 0;
+	v->metrics.len = 0;
+	return v;
+}
+
+/*
+ * Hand the view rendered into backview over to the server, and wake it to
+ * send the view to any subscribers.
+ */
+void publishview(struct server *srv)
+{
+	srv->back = __atomic_exchange_n(&srv->middle, srv->back | VIEW_FRESH,
+	                                __ATOMIC_ACQ_REL) & ~VIEW_FRESH;
+	if (__atomic_load_n(&srv->nsubscribers, __ATOMIC_RELAXED)) {
+		uint64_t one = 1;
+		if (write(srv->wake, &one, sizeof(one)) < 0) {
+			/* The count is full, so the server is already awake. */
+		}
+	}
+}
+
+/*
+ * Stop the server, close every client, and remove its sockets.
+ */
+void stopserver(struct server *srv)
+{
+	if (srv->running) {
+		uint64_t one = 1;
+		__atomic_store_n(&srv->stopping, 1, __ATOMIC_RELEASE);
+		if (write(srv->wake, &one, sizeof(one)) < 0) {
+			pthread_cancel(srv->thread);
+		}
+		pthread_join(srv->thread, NULL);
+		srv->running = 0;
+	}
+	if (srv->listen >= 0) {
+		close(srv->listen);
+		unlink(srv->querypath);
+	}
+	if (srv->sublisten >= 0) {
+		close(srv->sublisten);
+		unlink(srv->subpath);
+	}
+	if (srv->httplisten >= 0) {
+		close(srv->httplisten);
+	}
+	close(srv->epoll);
+	close(srv->wake);
+	close(srv->spare);
+	for (int i = 0; i < 3; i++) {
+		free(srv->views[i].util.data);
+		free(srv->views[i].cpus.data);
+		free(srv->views[i].metrics.data);
+		free(srv->views[i].update);
+	}
+}
+
+/*
+ * The body of the server thread: wait for clients to connect, send requests
+ * or have room for replies, until told to stop.
+ */
+static void *serverloop(void *arg)
+{
+	struct server *srv = arg;
+	struct epoll_event events[SERVER_EVENTS];
+
+	while (!__atomic_load_n(&srv->stopping, __ATOMIC_ACQUIRE)) {
+		int n = epoll_wait(srv->epoll, events, SERVER_EVENTS, -1);
+		for (int i = 0; i < n; i++) {
+			void *p = events[i].data.ptr;
+			if (p == &srv->listen || p == &srv->sublisten ||
+			    p == &srv->httplisten) {
+				acceptclients(srv, p);
+				continue;
+			}
+			if (p == &srv->wake) {
+				uint64_t count;
+				if (read(srv->wake, &count, sizeof(count)) > 0) {
+					sendupdates(srv);
+				}
+				continue;
+			}
+
+			/* A client dropped earlier in this batch, perhaps while
+			 * sending updates, is not freed until the batch is done,
+			 * so its events can be recognised and skipped. A
+			 * subscriber has nothing to say, so anything but room to
+			 * write means it has gone. */
+			struct client *c = p;
+			if (c->dropped) {
+				continue;
+			}
+			if (((events[i].events & (EPOLLERR | EPOLLHUP)) &&
+			     !(events[i].events & EPOLLIN)) ||
+			    (c->subscriber && (events[i].events & ~EPOLLOUT))) {
+				dropclient(srv, c);
+				continue;
+			}
+			if (c->subscriber) {
+				if (sendupdate(srv, c) < 0) {
+					dropclient(srv, c);
+				}
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && flushclient(srv, c) < 0) {
+				dropclient(srv, c);
+				continue;
+			}
+			if ((events[i].events & EPOLLIN) && readclient(srv, c) < 0) {
+				dropclient(srv, c);
+			}
+		}
+		freedropped(srv);
+	}
+
+	while (srv->clients) {
+		dropclient(srv, srv->clients);
+	}
+	while (srv->subscribers) {
+		dropclient(srv, srv->subscribers);
+	}
+	freedropped(srv);
+	return NULL;
+}
+
+/*
+ * Accept every client waiting to connect to the socket *listenfd, which says
+ * whether they will make queries, be sent updates or speak HTTP.
+ */
+static void acceptclients(struct server *srv, int *listenfd)
+{
+	int subscriber = listenfd == &srv->sublisten;
+	struct client **list = subscriber ? &srv->subscribers : &srv->clients;
+
+	for (;;) {
+		int fd = accept4(*listenfd, NULL, NULL,
+		                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if ((errno == EMFILE || errno == ENFILE) && srv->spare >= 0) {
+				/* Turn the client away with the spare descriptor. */
+				close(srv->spare);
+				fd = accept(*listenfd, NULL, NULL);
+				if (fd >= 0) {
+					close(fd);
+				}
+				srv->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				continue;
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return;
+		}
+
+		struct client *c = calloc(1, sizeof(*c));
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP };
+		ev.data.ptr = c;
+		if (!c || epoll_ctl(srv->epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->subscriber = subscriber;
+		c->http = listenfd == &srv->httplisten;
+		c->next = *list;
+		if (c->next) {
+			c->next->prev = c;
+		}
+		*list = c;
+		if (subscriber) {
+			__atomic_add_fetch(&srv->nsubscribers, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Read what the client has sent, and answer each whole line of it, or each
+ * whole HTTP request head.
+ *
+ * On success, 0 is returned.
+ * On failure, or when the client has gone, -1 is returned.
+ */
+static int readclient(struct server *srv, struct client *c)
+{
+	for (;;) {
+		ssize_t n = read(c->fd, c->in + c->inlen,
+		                 sizeof(c->in) - c->inlen);
+		if (n == 0) {
+			/* The client has finished sending; give it what replies
+			 * it will take before going. */
+			flushclient(srv, c);
+			return -1;
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN ? flushclient(srv, c) : -1;
+		}
+		c->inlen += n;
+
+		char *start = c->in, *nl;
+		while (!c->closing &&
+		       (nl = memchr(start, '\n', c->in + c->inlen - start))) {
+			if (c->http) {
+				if (!(nl = headend(nl, c->in + c->inlen))) {
+					break;
+				}
+				*nl = '\0';
+				c->closing = answerhttp(srv, start, &c->out);
+				start = nl + 1;
+				continue;
+			}
+			*nl = '\0';
+			if (nl > start && nl[-1] == '\r') {
+				nl[-1] = '\0';
+			}
+			answer(srv, start, &c->out);
+			start = nl + 1;
+		}
+		c->inlen -= start - c->in;
+		memmove(c->in, start, c->inlen);
+		if (c->closing) {
+			return flushclient(srv, c);
+		}
+		if (c->inlen >= (c->http ? sizeof(c->in) : SERVER_LINE) ||
+		    c->out.err || c->out.len - c->outoff > SERVER_BACKLOG) {
+			return -1; /* Too long a line, or not reading replies. */
+		}
+	}
+}
+
+/*
+ * Write as much of the replies waiting for the client as it will take, and
+ * wait for room for the rest.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned.
+ */
+static int flushclient(struct server *srv, struct client *c)
+{
+	while (c->outoff < c->out.len) {
+		ssize_t n = send(c->fd, c->out.data + c->outoff,
+		                 c->out.len - c->outoff, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				return -1;
+			}
+			break;
+		}
+		c->outoff += n;
+	}
+	if (c->outoff == c->out.len) {
+		c->out.len = c->outoff = 0;
+		if (c->closing) {
+			return -1;
+		}
+	}
+	return wantwrite(srv, c, c->outoff < c->out.len);
+}
+
+/*
+ * Wait for room to write to the client, if writing is set, or stop waiting.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned.
+ */
+static int wantwrite(struct server *srv, struct client *c, int writing)
+{
+	if (writing == c->writing) {
+		return 0;
+	}
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0)
+	};
+	ev.data.ptr = c;
+	if (epoll_ctl(srv->epoll, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+		return -1;
+	}
+	c->writing = writing;
+	return 0;
+}
+
+/*
+ * Disconnect a client, and leave it to be freed once nothing in the current
+ * batch of events can refer to it.
+ */
+static void dropclient(struct server *srv, struct client *c)
+{
+	if (c->dropped) {
+		return;
+	}
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else if (c->subscriber) {
+		srv->subscribers = c->next;
+	} else {
+		srv->clients = c->next;
+	}
+	if (c->subscriber) {
+		__atomic_sub_fetch(&srv->nsubscribers, 1, __ATOMIC_RELAXED);
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	close(c->fd);
+	c->dropped = 1;
+	c->next = srv->dropped;
+	srv->dropped = c;
+}
+
+/*
+ * Free the clients dropped since this was last called, once nothing can
+ * refer to them any more.
+ */
+static void freedropped(struct server *srv)
+{
+	while (srv->dropped) {
+		struct client *c = srv->dropped;
+		srv->dropped = c->next;
+		free(c->out.data);
+		free(c);
+	}
+}
+
+/*
+ * Take the newest view from the sampling loop, if there is one.
+ *
+ * Returns the newest view the server has.
+ */
+static const struct view *takeview(struct server *srv)
+{
+	if (__atomic_load_n(&srv->middle, __ATOMIC_RELAXED) & VIEW_FRESH) {
+		srv->front = __atomic_exchange_n(&srv->middle, srv->front,
+		                                 __ATOMIC_ACQ_REL) & ~VIEW_FRESH;
+		srv->seen = 1;
+	}
+	return &srv->views[srv->front];
+}
+
+/*
+ * Send the newest update to each subscriber with room for it. One without
+ * room skips it, and is sent the newest update once it has room, unless it
+ * falls more than CPUWATCH_UPDATE_PATIENCE updates behind, when it is
+ * dropped.
+ */
+static void sendupdates(struct server *srv)
+{
+	struct client *next;
+
+	for (struct client *c = srv->subscribers; c; c = next) {
+		next = c->next;
+		if (c->behind) {
+			if (++c->behind > CPUWATCH_UPDATE_PATIENCE) {
+				dropclient(srv, c);
+			}
+			continue;
+		}
+		if (sendupdate(srv, c) < 0) {
+			dropclient(srv, c);
+		}
+	}
+}
+
+/*
+ * Send the newest update to a subscriber, or wait for room to if it has none.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned.
+ */
+static int sendupdate(struct server *srv, struct client *c)
+{
+	const struct view *v = takeview(srv);
+	ssize_t n;
+
+	if (!srv->seen) {
+		return 0;
+	}
+	while ((n = send(c->fd, v->update, sizeof(*v->update),
+	                 MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	if (n < 0) {
+		if (errno != EAGAIN) {
+			return -1;
+		}
+		if (!c->behind) {
+			c->behind = 1;
+		}
+		return wantwrite(srv, c, 1);
+	}
+	c->behind = 0;
+	return wantwrite(srv, c, 0);
+}
+
+/*
+ * Append the answer to the request req to b, followed by an empty line. The
+ * requests are:
+ *  util         each average, as written to its output, after its length
+ *  cpus         each CPU's utilisation and modes, as written for --stat
+ *  range A B    the average between two times, from the history file
+ *  help         the requests
+ * A reply which is not an answer starts with "error: ".
+ */
+static void answer(struct server *srv, const char *req, struct buf *b)
+{
+	const struct view *v = takeview(srv);
+
+	if (!strcmp(req, "util") || !strcmp(req, "cpus")) {
+		const struct buf *text = req[0] == 'u' ? &v->util : &v->cpus;
+		if (!srv->seen || !text->len) {
+			bufputs(b, "error: nothing has been measured yet\n");
+		} else {
+			bufput(b, text->data, text->len);
+		}
+	} else if (!strncmp(req, "range ", 6)) {
+		const char *c = req + 6;
+		int64_t from, to;
+		double util;
+		if (!srv->history) {
+			bufputs(b, "error: no history is being kept\n");
+		} else if (parsetime(&c, &from) < 0 || parsetime(&c, &to) < 0 ||
+		           *c || to < from) {
+			bufputs(b, "error: could not understand the range\n");
+		} else if (queryhistory(srv->history, from, to, &util) < 0) {
+			bufputs(b, "error: ");
+			bufputs(b, strerror(errno));
+			bufputs(b, "\n");
+		} else {
+			bufputpercent(b, util);
+			bufputs(b, "\n");
+		}
+	} else if (!strcmp(req, "help")) {
+		bufputs(b, "util\ncpus\nrange FROM TO\nhelp\n");
+	} else if (req[0]) {
+		bufputs(b, "error: unknown request\n");
+	}
+	bufputs(b, "\n");
+}
+
+/*
+ * Find the end of an HTTP request head, which is ended by an empty line,
+ * looking from the line ending at nl up to end.
+ *
+ * Returns the newline ending the empty line, or NULL if it has not arrived.
+ */
+static char *headend(char *nl, const char *end)
+{
+	for (; nl; nl = memchr(nl + 1, '\n', end - nl - 1)) {
+		if (end - nl > 1 && nl[1] == '\n') {
+			return nl + 1;
+		}
+		if (end - nl > 2 && nl[1] == '\r' && nl[2] == '\n') {
+			return nl + 2;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Append a complete HTTP response to b: the status line, the headers, and
+ * len bytes of body, unless only the head was asked for.
+ */
+static void reply(struct buf *b, const char *status, const char *type,
+                  const char *body, size_t len, int headonly, int closing)
+{
+	bufputs(b, "HTTP/1.1 ");
+	bufputs(b, status);
+	bufputs(b, "\r\nContent-Type: ");
+	bufputs(b, type);
+	bufputs(b, "\r\nContent-Length: ");
+	bufputu(b, len);
+	bufputs(b, closing ? "\r\nConnection: close\r\n\r\n" : "\r\n\r\n");
+	if (!headonly) {
+		bufput(b, body, len);
+	}
+}
+
+/*
+ * Append the response to the HTTP request whose head is req to b. Only GET
+ * and HEAD of /metrics are served, with the metrics rendered for the newest
+ * view, so a scrape costs no more than copying them. The connection is kept
+ * open for more requests unless the client asks otherwise, or sends a body,
+ * which is not read.
+ *
+ * Returns 1 if the connection should be closed once the response is sent, or
+ * 0 if not.
+ */
+static int answerhttp(struct server *srv, char *req, struct buf *b)
+{
+	static const char text[] = "text/plain; charset=utf-8";
+	const struct view *v = takeview(srv);
+
+	req += strspn(req, "\r\n");
+	char *line = strsep(&req, "\n");
+	char *method = strsep(&line, " ");
+	char *target = strsep(&line, " ");
+	char *version = line ? strsep(&line, "\r") : NULL;
+	if (!target || !version || strncmp(version, "HTTP/1.", 7)) {
+		reply(b, "400 Bad Request", text, "", 0, 0, 1);
+		return 1;
+	}
+
+	int closing = strcmp(version, "HTTP/1.1") != 0;
+	int body = 0;
+	while ((line = strsep(&req, "\n"))) {
+		if (!strncasecmp(line, "connection:", 11)) {
+			if (strcasestr(line, "close")) {
+				closing = 1;
+			} else if (strcasestr(line, "keep-alive")) {
+				closing = 0;
+			}
+		} else if ((!strncasecmp(line, "content-length:", 15) &&
+		            strtoul(line + 15, NULL, 10) != 0) ||
+		           !strncasecmp(line, "transfer-encoding:", 18)) {
+			body = 1;
+		}
+	}
+	closing |= body;
+
+	int headonly = !strcmp(method, "HEAD");
+	if (!headonly && strcmp(method, "GET")) {
+		reply(b, "405 Method Not Allowed", text, "GET or HEAD only\n", 17,
+		      0, 1);
+		return 1;
+	}
+	if (strcmp(target, "/metrics") && strncmp(target, "/metrics?", 9)) {
+		reply(b, "404 Not Found", text, "Not found; try /metrics\n", 24,
+		      headonly, closing);
+	} else if (!srv->seen || !v->metrics.len) {
+		reply(b, "503 Service Unavailable", text,
+		      "Nothing has been measured yet\n", 30, headonly, closing);
+	} else {
+		reply(b, "200 OK", "text/plain; version=0.0.4; charset=utf-8",
+		      v->metrics.data, v->metrics.len, headonly, closing);
+	}
+	return closing;
+}
@@ -0,0 +1,100 @@
+/*
+ * Publication of samples in POSIX shared memory.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cpuwatch.h"
+#include "cpuwatch-client.h"
+
+_Static_assert(MAXWINDOWS <= CPUWATCH_SHM_MAXWINDOWS,
+               "every window must fit in the shared memory segment");
+
+/*
+ * Create (or reuse) the shared memory segment with the given name and map it
+ * for writing. The layout is described in cpuwatch-client.h.
+ *
+ * The segment is left in place when cpuwatch exits, so readers keep seeing
+ * the last sample (with its timestamp) rather than failing.
+ *
+ * On success, the mapping is returned.
+ * On failure, NULL is returned, and errno is set to indicate the error.
+ */
+struct cpuwatch_shm *openshm(const char *name)
+{
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Could not open shared memory '%s' (%s)\n",
+		        argv0, name, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(struct cpuwatch_shm)) < 0) {
+		fprintf(stderr, "%s: Could not resize shared memory '%s' (%s)\n",
+		        argv0, name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	void *p = mmap(NULL, sizeof(struct cpuwatch_shm), PROT_READ | PROT_WRITE,
+	               MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: Could not map shared memory '%s' (%s)\n",
+		        argv0, name, strerror(errno));
+		return NULL;
+	}
+
+	/* Start from an even sequence number in case a previous run was killed
+	 * part way through an update. Readers which mapped the segment during a
+	 * previous run carry on working. */
+	struct cpuwatch_shm *shm = p;
+	uint64_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->seq, (seq + 1) & ~(uint64_t)1, __ATOMIC_RELAXED);
+	shm->version = CPUWATCH_SHM_VERSION;
+	__atomic_store_n(&shm->magic, CPUWATCH_SHM_MAGIC, __ATOMIC_RELEASE);
+	return shm;
+}
+
+/*
+ * Publish a sample in the segment. This makes no system calls and never
+ * waits for readers.
+ */
+void publishshm(struct cpuwatch_shm *shm, const struct cpuwatch_snapshot *snap)
+{
+	uint64_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&shm->sample, snap->sample, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->realtime, snap->realtime, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->monotonic, snap->monotonic, __ATOMIC_RELAXED);
+	__atomic_store(&shm->util, (double *)&snap->util, __ATOMIC_RELAXED);
+	__atomic_store(&shm->ncpu, (double *)&snap->ncpu, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->nwindows, snap->nwindows, __ATOMIC_RELAXED);
+	for (uint32_t i = 0; i < snap->nwindows; i++) {
+		__atomic_store(&shm->windows[i].util, (double *)&snap->windows[i].util,
+		               __ATOMIC_RELAXED);
+		__atomic_store(&shm->windows[i].seconds,
+		               (double *)&snap->windows[i].seconds, __ATOMIC_RELAXED);
+		__atomic_store(&shm->windows[i].p50, (double *)&snap->windows[i].p50,
+		               __ATOMIC_RELAXED);
+		__atomic_store(&shm->windows[i].p90, (double *)&snap->windows[i].p90,
+		               __ATOMIC_RELAXED);
+		__atomic_store(&shm->windows[i].p99, (double *)&snap->windows[i].p99,
+		               __ATOMIC_RELAXED);
+		__atomic_store(&shm->windows[i].max, (double *)&snap->windows[i].max,
+		               __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
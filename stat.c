@@ -0,0 +1,243 @@
+/*
+ * Per-CPU time accounting read from /proc/stat.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpuwatch.h"
+
+const char *const modenames[NMODES] = {
+	"user", "nice", "system", "idle", "iowait",
+	"irq", "softirq", "steal", "guest", "guest_nice"
+};
+
+static int growstat(struct cpustat *st, int cap);
+
+/*
+ * Parse the contents of /proc/stat from buf into st. The structure should be
+ * zeroed before its first use, and may be reused for later calls.
+ *
+ * Only the lines beginning "cpu" are of interest, and they come first, so
+ * parsing stops at the first line which does not. The counters are plain
+ * decimal integers, so they are converted by hand without going through
+ * scanf. Older kernels have fewer columns; the missing ones are set to 0.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int parsestat(struct cpustat *st, const char *buf, size_t len)
+{
+	const char *c = buf;
+	const char *end = buf + len;
+	int n = 0;
+	int all = 0;
+
+	while (end - c > 3 && c[0] == 'c' && c[1] == 'p' && c[2] == 'u') {
+		c += 3;
+
+		uint64_t *t;
+		uint64_t row[NMODES];
+		if (*c == ' ') {
+			t = st->all;
+			all = 1;
+		} else {
+			int id = 0;
+			for (; c < end && *c >= '0' && *c <= '9'; c++) {
+				id = id * 10 + (*c - '0');
+			}
+			if (n == st->cap && growstat(st, st->cap ? st->cap * 2 : 64) < 0) {
+				return -1;
+			}
+			st->id[n] = id;
+			t = row;
+		}
+
+		int m = 0;
+		for (; m < NMODES; m++) {
+			while (c < end && *c == ' ') {
+				c++;
+			}
+			if (c == end || *c < '0' || *c > '9') {
+				break;
+			}
+			uint64_t v = 0;
+			for (; c < end && *c >= '0' && *c <= '9'; c++) {
+				v = v * 10 + (*c - '0');
+			}
+			t[m] = v;
+		}
+		for (; m < NMODES; m++) {
+			t[m] = 0;
+		}
+
+		if (t == row) {
+			for (m = 0; m < NMODES; m++) {
+				st->mode[m][n] = row[m];
+			}
+			n++;
+		}
+
+		while (c < end && *c++ != '\n');
+	}
+
+	if (!all) {
+		errno = EINVAL;
+		return -1;
+	}
+	st->ncpu = n;
+	return 0;
+}
+
+/*
+ * Compute the time each CPU spent in each mode between two readings.
+ *
+ * When the same CPUs are listed in both readings (the usual case) the
+ * counters are subtracted array by array. If a CPU was brought online or
+ * taken offline in between, CPUs are matched by number, and a CPU which is
+ * new in cur is given a difference of 0. Counters which have gone backwards
+ * (iowait is known to) are also given a difference of 0.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int statdelta(struct cpustat *delta, const struct cpustat *cur,
+              const struct cpustat *prev)
+{
+	int n = cur->ncpu;
+	if (n > delta->cap && growstat(delta, n) < 0) {
+		return -1;
+	}
+	delta->ncpu = n;
+	memcpy(delta->id, cur->id, n * sizeof(*delta->id));
+
+	for (int m = 0; m < NMODES; m++) {
+		delta->all[m] = cur->all[m] > prev->all[m] ?
+		                cur->all[m] - prev->all[m] : 0;
+	}
+
+	if (n == prev->ncpu && !memcmp(cur->id, prev->id, n * sizeof(*cur->id))) {
+		for (int m = 0; m < NMODES; m++) {
+			const uint64_t *a = cur->mode[m];
+			const uint64_t *b = prev->mode[m];
+			uint64_t *d = delta->mode[m];
+			for (int i = 0; i < n; i++) {
+				d[i] = a[i] > b[i] ? a[i] - b[i] : 0;
+			}
+		}
+		return 0;
+	}
+
+	/* Both lists are in ascending order of CPU number, so they can be
+	 * matched up in a single pass. */
+	for (int i = 0, j = 0; i < n; i++) {
+		while (j < prev->ncpu && prev->id[j] < cur->id[i]) {
+			j++;
+		}
+		int found = j < prev->ncpu && prev->id[j] == cur->id[i];
+		for (int m = 0; m < NMODES; m++) {
+			uint64_t a = cur->mode[m][i];
+			uint64_t b = found ? prev->mode[m][j] : a;
+			delta->mode[m][i] = a > b ? a - b : 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Return the time in t which was spent doing work, and set total to the time
+ * in all modes. Guest time is already counted in user and nice time, so it is
+ * left out of the total. Idle and iowait are the only modes which are not
+ * work.
+ */
+uint64_t statbusy(const uint64_t *t, uint64_t *total)
+{
+	uint64_t idle = t[MODE_IDLE] + t[MODE_IOWAIT];
+	uint64_t sum = idle + t[MODE_USER] + t[MODE_NICE] + t[MODE_SYSTEM] +
+	               t[MODE_IRQ] + t[MODE_SOFTIRQ] + t[MODE_STEAL];
+	*total = sum;
+	return sum - idle;
+}
+
+/*
+ * Append the utilisation of each CPU, and the share of its time spent in each
+ * mode, to b. The first line is for all CPUs together, then one line follows
+ * for each CPU, e.g.:
+ *  cpu0 12.3% user 10.1 nice 0.0 system 2.2 idle 87.7 ...
+ */
+void renderstat(const struct cpustat *delta, struct buf *b)
+{
+	uint64_t t[NMODES];
+
+	for (int i = -1; i < delta->ncpu; i++) {
+		for (int m = 0; m < NMODES; m++) {
+			t[m] = i < 0 ? delta->all[m] : delta->mode[m][i];
+		}
+
+		uint64_t total;
+		uint64_t busy = statbusy(t, &total);
+		double scale = total ? 100.0 / total : 0;
+
+		bufput(b, "cpu", 3);
+		if (i >= 0) {
+			bufputu(b, delta->id[i]);
+		}
+		bufput(b, " ", 1);
+		bufputpercent(b, busy * scale);
+		for (int m = 0; m < NMODES; m++) {
+			bufput(b, " ", 1);
+			bufputs(b, modenames[m]);
+			bufput(b, " ", 1);
+			bufputfixed(b, t[m] * scale);
+		}
+		bufput(b, "\n", 1);
+	}
+}
+
+/*
+ * Free the arrays held by st, leaving it empty.
+ */
+void freestat(struct cpustat *st)
+{
+	free(st->id);
+	for (int m = 0; m < NMODES; m++) {
+		free(st->mode[m]);
+	}
+	memset(st, 0, sizeof(*st));
+}
+
+/*
+ * Grow the arrays in st to hold at least cap CPUs.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+static int growstat(struct cpustat *st, int cap)
+{
+	int *id = realloc(st->id, cap * sizeof(*id));
+	if (!id) {
+		goto fail;
+	}
+	st->id = id;
+
+	for (int m = 0; m < NMODES; m++) {
+		uint64_t *v = realloc(st->mode[m], cap * sizeof(*v));
+		if (!v) {
+			goto fail;
+		}
+		st->mode[m] = v;
+	}
+
+	st->cap = cap;
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: Could not allocate counters for %d CPUs (%s)\n",
+	        argv0, cap, strerror(errno));
+	return -1;
+}
@@ -0,0 +1,136 @@
+/*
+ * Scheduling of samples on absolute deadlines.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpuwatch.h"
+
+/*
+ * Start a schedule of deadlines separated by interval seconds, the first of
+ * which is now.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int tickinit(struct tick *t, double interval)
+{
+	t->period = llround(interval * 1e9);
+	t->overruns = 0;
+	t->warnat = 1;
+	t->stop = NULL;
+	t->late = 0;
+	if (monotime(&t->next) < 0) {
+		fprintf(stderr, "%s: Could not read the clock (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Sleep until the next deadline.
+ *
+ * Deadlines are kept as absolute times on CLOCK_MONOTONIC, so the time spent
+ * working between calls does not delay the ones which follow, and samples do
+ * not drift. If one or more deadlines have already passed by the time this is
+ * called, they are counted in t->overruns and skipped, so that a late sample
+ * is followed by one on the usual schedule rather than a burst of them. A
+ * warning is printed each time the total number of overruns doubles.
+ *
+ * If t->stop is set and a signal handler sets the flag it points to, this
+ * returns early so the caller can notice. How late the wait ended is left in
+ * t->late.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int tickwait(struct tick *t)
+{
+	if (t->period <= 0) {
+		return 0;
+	}
+	t->next += t->period;
+
+	int64_t now;
+	if (monotime(&now) < 0) {
+		fprintf(stderr, "%s: Could not read the clock (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+	if (now >= t->next) {
+		int64_t missed = (now - t->next) / t->period + 1;
+		t->next += missed * t->period;
+		t->overruns += missed;
+
+		if (t->overruns >= t->warnat) {
+			fprintf(stderr, "%s: Missed %lu sampling deadline(s) so far\n",
+			        argv0, t->overruns);
+			t->warnat = t->overruns * 2;
+		}
+	}
+
+	struct timespec ts = {
+		.tv_sec = t->next / 1000000000,
+		.tv_nsec = t->next % 1000000000
+	};
+	int err;
+	while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))) {
+		if (err == EINTR && t->stop && *t->stop) {
+			break;
+		}
+		if (err != EINTR) {
+			fprintf(stderr, "%s: Error in clock_nanosleep (%s)\n",
+			        argv0, strerror(err));
+			errno = err;
+			return -1;
+		}
+	}
+
+	if (monotime(&now) < 0) {
+		fprintf(stderr, "%s: Could not read the clock (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+	t->late = now - t->next;
+	return 0;
+}
+
+/*
+ * Read CLOCK_MONOTONIC in nanoseconds.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int monotime(int64_t *ns)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		return -1;
+	}
+	*ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return 0;
+}
+
+/*
+ * Read CLOCK_REALTIME in nanoseconds.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int walltime(int64_t *ns)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
+		return -1;
+	}
+	*ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return 0;
+}
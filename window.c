@@ -0,0 +1,202 @@
+/*
+ * Moving averages over the history of samples.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpuwatch.h"
+
+/*
+ * Allocate a ring buffer with room for size samples.
+ *
+ * The buffer is allocated on the heap rather than the stack so that very long
+ * windows (millions of samples) can be used. Memory for samples that have not
+ * been written yet is never touched.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int ringinit(struct ring *ring, size_t size)
+{
+	if (size == 0 || size > SIZE_MAX / sizeof(*ring->buf)) {
+		errno = EINVAL;
+		fprintf(stderr, "%s: Cannot keep %zu samples\n", argv0, size);
+		return -1;
+	}
+
+	ring->buf = malloc(size * sizeof(*ring->buf));
+	if (!ring->buf) {
+		fprintf(stderr, "%s: Could not allocate %zu samples (%s)\n",
+		        argv0, size, strerror(errno));
+		return -1;
+	}
+	ring->size = size;
+	ring->head = 0;
+	ring->count = 0;
+	return 0;
+}
+
+/*
+ * Store a sample in the ring, overwriting the oldest one once it is full.
+ * This does a constant amount of work regardless of the size of the ring.
+ */
+void ringpush(struct ring *ring, const struct sample *s)
+{
+	ring->buf[ring->head] = *s;
+	if (++ring->head == ring->size) {
+		ring->head = 0;
+	}
+	if (ring->count < ring->size) {
+		ring->count++;
+	}
+}
+
+/*
+ * Return the sample pushed ago samples before the newest one, which is 0
+ * samples ago. If the ring does not go back that far, the oldest sample is
+ * returned instead: until the ring fills up this is the first sample ever
+ * pushed, so a moving average over a partial window is measured from the
+ * first reading.
+ */
+const struct sample *ringago(const struct ring *ring, size_t ago)
+{
+	if (ago >= ring->count) {
+		ago = ring->count - 1;
+	}
+	size_t i = ring->head >= ago + 1 ? ring->head - ago - 1 :
+	           ring->head + ring->size - ago - 1;
+	return &ring->buf[i];
+}
+
+/*
+ * Return the utilisation between two samples, as a percentage.
+ */
+static double intervalutil(const struct sample *old, const struct sample *s)
+{
+	double idletimediff = s->idle - old->idle;
+	double totaldiff = s->total - old->total;
+	return 100 - 100 * (idletimediff / totaldiff);
+}
+
+/*
+ * Start a window from the first sample. Until there is a second sample the
+ * window holds the average utilisation since the system booted.
+ */
+void initwindow(struct window *w, const struct sample *s)
+{
+	w->util = 100 - 100 * (s->idle / s->total);
+	w->p50 = w->p90 = w->p99 = w->max = w->util;
+	if (w->hist) {
+		histclear(w->hist);
+	}
+}
+
+/*
+ * Bring the window up to date with the newest sample in the ring. This looks
+ * at two samples whatever the length of the window, and any number of windows
+ * can share one ring as long as it is at least one sample longer than the
+ * longest window.
+ *
+ * An exponentially-weighted average only needs the last interval. It moves
+ * towards the utilisation over that interval by a fraction depending on how
+ * long the interval really was, so a late sample is given more weight rather
+ * than being treated as if it were on time:
+ *  a = 1 - 2^(-DT / HALFLIFE)
+ *  u = u + a * (LAST - u)
+ *
+ * If the window keeps a histogram, the utilisation over the newest interval
+ * is added to it and the one over the interval which has just left the window
+ * is removed, which needs the ring to be two samples longer than the window.
+ * Percentiles are then read from the histogram.
+ */
+void updatewindow(struct window *w, const struct ring *ring)
+{
+	const struct sample *s = ringago(ring, 0);
+	const struct sample *old = ringago(ring, w->samples);
+
+	if (w->halflife > 0) {
+		double dt = s->uptime - old->uptime;
+		double totaldiff = s->total - old->total;
+		if (dt <= 0 || totaldiff <= 0) {
+			return;
+		}
+		double last = intervalutil(old, s);
+		double a = -expm1(-dt * M_LN2 / w->halflife);
+		w->util += a * (last - w->util);
+		return;
+	}
+
+	w->util = intervalutil(old, s);
+
+	if (w->hist && ring->count >= 2) {
+		histadd(w->hist, intervalutil(ringago(ring, 1), s));
+		if (ring->count >= (size_t)w->samples + 2) {
+			histremove(w->hist, intervalutil(ringago(ring, w->samples + 1),
+			                                 ringago(ring, w->samples)));
+		}
+		w->p50 = histquantile(w->hist, 0.50);
+		w->p90 = histquantile(w->hist, 0.90);
+		w->p99 = histquantile(w->hist, 0.99);
+		w->max = histquantile(w->hist, 1.00);
+	}
+}
+
+/*
+ * Decide whether the window's output should be written at the time now. It
+ * always should, unless the window has a threshold, in which case it is only
+ * written if one of the figures, as written to one decimal place, has moved
+ * by more than the threshold since the last write, or the heartbeat has
+ * passed since then. If it should, the figures are noted as written.
+ *
+ * Returns 1 if the output should be written, or 0 if not.
+ */
+int windowchanged(struct window *w, int64_t now)
+{
+	double figures[5] = { w->util, w->p50, w->p90, w->p99, w->max };
+	int n = w->hist ? 5 : 1;
+
+	if (w->threshold >= 0 && w->written &&
+	    (!w->heartbeat || now - w->shownat < w->heartbeat)) {
+		int moved = 0;
+		for (int i = 0; i < n && !moved; i++) {
+			moved = fabs(round(figures[i] * 10) -
+			             round(w->shown[i] * 10)) > w->threshold * 10;
+		}
+		if (!moved) {
+			return 0;
+		}
+	}
+	memcpy(w->shown, figures, sizeof(figures));
+	w->shownat = now;
+	w->written = 1;
+	return 1;
+}
+
+/*
+ * Append the window's average to b as a percentage, e.g. "12.3%". If it keeps
+ * a histogram, percentiles and the maximum over the intervals in the window
+ * follow on the same line:
+ *  12.3% p50=10.1% p90=20.5% p99=45.0% max=51.2%
+ */
+void renderwindow(const struct window *w, struct buf *b)
+{
+	bufputpercent(b, w->util);
+	if (!w->hist) {
+		return;
+	}
+	bufputs(b, " p50=");
+	bufputpercent(b, w->p50);
+	bufputs(b, " p90=");
+	bufputpercent(b, w->p90);
+	bufputs(b, " p99=");
+	bufputpercent(b, w->p99);
+	bufputs(b, " max=");
+	bufputpercent(b, w->max);
+}
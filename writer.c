@@ -0,0 +1,247 @@
+/*
+ * Writer threads, which write output files so that the sampling loop never
+ * waits for them.
+ *
+ * Copyright 2022 Jason Moore <jason@jasonmoore.xyz>
+ * Released under the MIT license; see LICENSE for details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpuwatch.h"
+
+/* How long to give writers to finish their queues on the way out, in
+ * seconds. */
+#define WRITER_GRACE 1
+
+static void *writerloop(void *arg);
+
+/*
+ * Start n writer threads, each with a queue of WRITER_QUEUE jobs, or none if
+ * n is 0, in which case outputs are written by the caller. If block is set,
+ * a full queue is waited on rather than dropping outputs, for when there is
+ * no schedule to keep to.
+ *
+ * Each writer has a ring of jobs which only the sampling loop adds to and
+ * only that writer takes from, so neither side ever takes a lock: the
+ * sampling loop fills in the job at head and then publishes it by moving
+ * head on, and the writer does the same with tail once the job is written.
+ * A semaphore wakes the writer when there is work. Each job owns a buffer
+ * which is reused, so once they have grown no memory is allocated. Signals
+ * are blocked in the writers, so they are always handled by the caller.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int startwriters(struct writers *ws, int n, int block)
+{
+	memset(ws, 0, sizeof(*ws));
+	ws->block = block;
+	if (n == 0) {
+		return 0;
+	}
+
+	ws->w = calloc(n, sizeof(*ws->w));
+	if (!ws->w) {
+		fprintf(stderr, "%s: Could not allocate writers (%s)\n",
+		        argv0, strerror(errno));
+		return -1;
+	}
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < n; i++) {
+		struct writer *w = &ws->w[i];
+		w->warnat = 1;
+		int err = sem_init(&w->ready, 0, 0) < 0 ? errno :
+		          pthread_create(&w->thread, NULL, writerloop, w);
+		if (err) {
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			fprintf(stderr, "%s: Could not start a writer thread (%s)\n",
+			        argv0, strerror(err));
+			errno = err;
+			return -1;
+		}
+		ws->n++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return 0;
+}
+
+/*
+ * Begin the text to be written to output i, which is out. The text should be
+ * built up in the buffer returned, and then handed over with outputend.
+ *
+ * Outputs are shared out between the writers in turn. If the writer for this
+ * output has fallen so far behind that its queue is full, the text is
+ * dropped, as a newer one will replace it soon enough, and the overflow is
+ * counted, with a warning each time the count doubles, unless ws->block is
+ * set.
+ *
+ * Returns the buffer, or NULL if the text should not be built.
+ */
+struct buf *outputbegin(struct writers *ws, int i, struct output *out)
+{
+	if (ws->n == 0) {
+		ws->local.len = 0;
+		return &ws->local;
+	}
+
+	struct writer *w = &ws->w[i % ws->n];
+	size_t tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+	while (ws->block && w->head - tail == WRITER_QUEUE &&
+	       !__atomic_load_n(&w->failed, __ATOMIC_RELAXED)) {
+		sched_yield();
+		tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+	}
+	if (w->head - tail == WRITER_QUEUE) {
+		w->overflows++;
+		if (w->overflows >= w->warnat) {
+			fprintf(stderr, "%s: Writer %d has fallen behind; %lu "
+			        "output(s) dropped so far\n",
+			        argv0, i % ws->n, w->overflows);
+			w->warnat = w->overflows * 2;
+		}
+		return NULL;
+	}
+
+	struct writejob *job = &w->jobs[w->head % WRITER_QUEUE];
+	job->out = out;
+	job->text.len = 0;
+	return &job->text;
+}
+
+/*
+ * Hand over the text built up in b for output i, which is out: write it now,
+ * or publish it to the output's writer.
+ *
+ * On success, 0 is returned.
+ * On failure, -1 is returned, and errno is set to indicate the error.
+ */
+int outputend(struct writers *ws, int i, struct output *out, struct buf *b)
+{
+	if (b->err) {
+		fprintf(stderr, "%s: Could not allocate a buffer (%s)\n",
+		        argv0, strerror(errno));
+		b->err = 0;
+		return -1;
+	}
+	if (ws->n == 0) {
+		return writeoutput(out, b->data, b->len);
+	}
+
+	struct writer *w = &ws->w[i % ws->n];
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+	sem_post(&w->ready);
+	return 0;
+}
+
+/*
+ * Check whether any writer has stopped because it failed to write an output,
+ * having said why on stderr.
+ *
+ * Returns 1 if one has, or 0 if not.
+ */
+int writersfailed(const struct writers *ws)
+{
+	for (int i = 0; i < ws->n; i++) {
+		if (__atomic_load_n(&ws->w[i].failed, __ATOMIC_RELAXED)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Count the outputs dropped so far because writers fell behind.
+ */
+unsigned long outputoverflows(const struct writers *ws)
+{
+	unsigned long n = 0;
+
+	for (int i = 0; i < ws->n; i++) {
+		n += ws->w[i].overflows;
+	}
+	return n;
+}
+
+/*
+ * Let each writer finish the jobs in its queue, and wait for it to stop. A
+ * writer which is still stuck after WRITER_GRACE seconds, perhaps opening a
+ * FIFO which nothing reads, is cancelled so that the program can exit.
+ *
+ * On success, 0 is returned.
+ * On failure of any writer, -1 is returned.
+ */
+int stopwriters(struct writers *ws)
+{
+	int failed = 0;
+	struct timespec deadline;
+
+	for (int i = 0; i < ws->n; i++) {
+		__atomic_store_n(&ws->w[i].stopping, 1, __ATOMIC_RELEASE);
+		sem_post(&ws->w[i].ready);
+	}
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += WRITER_GRACE;
+
+	for (int i = 0; i < ws->n; i++) {
+		struct writer *w = &ws->w[i];
+		if (pthread_timedjoin_np(w->thread, NULL, &deadline)) {
+			fprintf(stderr, "%s: Writer %d did not finish; %zu output(s) "
+			        "left unwritten\n", argv0, i, w->head -
+			        __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE));
+			pthread_cancel(w->thread);
+			pthread_join(w->thread, NULL);
+			failed = 1;
+		}
+		failed |= w->failed;
+		for (int j = 0; j < WRITER_QUEUE; j++) {
+			free(w->jobs[j].text.data);
+		}
+		sem_destroy(&w->ready);
+	}
+	free(ws->w);
+	free(ws->local.data);
+	memset(ws, 0, sizeof(*ws));
+	return failed ? -1 : 0;
+}
+
+/*
+ * The body of a writer thread: write each job as it is published, until told
+ * to stop and the queue is empty, or a write fails.
+ */
+static void *writerloop(void *arg)
+{
+	struct writer *w = arg;
+	size_t tail = 0;
+
+	for (;;) {
+		while (sem_wait(&w->ready) < 0 && errno == EINTR);
+
+		size_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			struct writejob *job = &w->jobs[tail % WRITER_QUEUE];
+			if (writeoutput(job->out, job->text.data,
+			                job->text.len) < 0) {
+				__atomic_store_n(&w->failed, 1, __ATOMIC_RELAXED);
+				return NULL;
+			}
+			__atomic_store_n(&w->tail, tail + 1, __ATOMIC_RELEASE);
+		}
+
+		if (__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE) &&
+		    tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+	}
+}